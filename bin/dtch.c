@@ -14,11 +14,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// glibc only declares wcwidth for X/Open, which alone would hide cfmakeraw.
+#define _GNU_SOURCE
+
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,11 +32,13 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <termios.h>
 #include <unistd.h>
+#include <wchar.h>
 
 #if defined __FreeBSD__
 #include <libutil.h>
@@ -41,11 +49,15 @@
 #endif
 
 static char _;
-static struct iovec iov = { .iov_base = &_, .iov_len = 1 };
 
-static ssize_t sendfd(int sock, int fd) {
+// The byte sent with the PTY tells the client whether to read output from
+// the PTY itself or from the socket.
+enum { Direct, Fanout };
+
+static ssize_t sendfd(int sock, int fd, char mode) {
 	size_t len = CMSG_SPACE(sizeof(int));
 	char buf[len];
+	struct iovec iov = { .iov_base = &mode, .iov_len = 1 };
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
@@ -62,9 +74,10 @@ static ssize_t sendfd(int sock, int fd) {
 	return sendmsg(sock, &msg, 0);
 }
 
-static int recvfd(int sock) {
+static int recvfd(int sock, char *mode) {
 	size_t len = CMSG_SPACE(sizeof(int));
 	char buf[len];
+	struct iovec iov = { .iov_base = mode, .iov_len = 1 };
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
@@ -83,27 +96,1186 @@ static int recvfd(int sock) {
 
 static struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
+static void reap(pid_t pid, int options) {
+	int status;
+	pid_t dead = waitpid(pid, &status, options);
+	if (dead < 0) err(EX_OSERR, "waitpid");
+	if (dead) {
+		unlink(addr.sun_path);
+		exit(WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+	}
+}
+
+static size_t min(size_t a, size_t b) {
+	return (a < b ? a : b);
+}
+
+typedef unsigned uint;
+
+// In fan-out mode, the session also keeps the state of its terminal, so
+// that attaching clients can be sent the current screen directly rather
+// than relying on the application to redraw it.
+enum {
+	Bold      = 1 << 0,
+	Dim       = 1 << 1,
+	Italic    = 1 << 2,
+	Underline = 1 << 3,
+	Blink     = 1 << 4,
+	Reverse   = 1 << 5,
+	Invisible = 1 << 6,
+	Strike    = 1 << 7,
+};
+
+// Colors are -1 for the default, 0 to 255 for the palette, or TrueColor
+// with 24-bit RGB.
+enum { TrueColor = 1 << 24 };
+
+struct Style {
+	uint attr;
+	int fg, bg;
+};
+
+static const struct Style Default = { .fg = -1, .bg = -1 };
+
+// Zero-width characters are kept with the character they combine with.
+enum { CombiningCap = 2 };
+
+struct Cell {
+	struct Style style;
+	wchar_t ch;
+	wchar_t combining[CombiningCap];
+};
+
+// DEC private modes replayed on attach.
+static const uint Modes[] = {
+	1, 7, 25, 1000, 1002, 1003, 1004, 1005, 1006, 1015, 2004,
+};
+enum {
+	ModeWrap = 1,
+	ModeCursor = 2,
+	ModesLen = sizeof(Modes) / sizeof(*Modes),
+};
+
+struct Line {
+	uint len;
+	struct Cell cells[];
+};
+
+enum { ParamCap = 16 };
+
+enum State {
+	Data,
+	Esc,
+	EscInter,
+	CSI,
+	String,
+	StringEsc,
+};
+
+struct Term {
+	uint rows, cols;
+	struct Cell *cells, *other;
+	bool alt;
+	uint y, x;
+	uint top, bot;
+	struct Style style;
+	struct {
+		uint y, x;
+		struct Style style;
+	} save;
+	bool insert, keypad, special;
+	bool modes[ModesLen];
+	struct {
+		struct Line **lines;
+		uint cap, len, head;
+	} hist;
+	struct {
+		uint s[ParamCap];
+		uint n;
+		char private, inter;
+	} param;
+	enum State state;
+	mbstate_t mbs;
+};
+
+// The terminal being updated or redrawn.
+static struct Term *term;
+
+static struct Cell *cell(uint y, uint x) {
+	return &term->cells[y * term->cols + x];
+}
+
+static void erase(struct Cell *at, struct Cell *to) {
+	struct Style style = { .fg = -1, .bg = term->style.bg };
+	for (; at < to; ++at) {
+		*at = (struct Cell) { .style = style, .ch = L' ' };
+	}
+}
+
+static void histPush(const struct Cell *cells) {
+	uint len = term->cols;
+	while (len && cells[len - 1].ch == L' ') len--;
+	struct Line *line = malloc(sizeof(*line) + sizeof(*cells) * len);
+	if (!line) err(EX_OSERR, "malloc");
+	line->len = len;
+	memcpy(line->cells, cells, sizeof(*cells) * len);
+	if (term->hist.len < term->hist.cap) {
+		uint i = (term->hist.head + term->hist.len++) % term->hist.cap;
+		term->hist.lines[i] = line;
+		return;
+	}
+	free(term->hist.lines[term->hist.head]);
+	term->hist.lines[term->hist.head] = line;
+	term->hist.head = (term->hist.head + 1) % term->hist.cap;
+}
+
+static void scrollUp(uint top, uint n) {
+	if (top >= term->bot) return;
+	n = min(n, term->bot - top);
+	if (!top && !term->alt && term->hist.cap) {
+		for (uint i = 0; i < n; ++i) histPush(cell(i, 0));
+	}
+	memmove(
+		cell(top, 0), cell(top + n, 0),
+		sizeof(struct Cell) * term->cols * (term->bot - top - n)
+	);
+	erase(cell(term->bot - n, 0), cell(term->bot, 0));
+}
+
+static void scrollDown(uint top, uint n) {
+	if (top >= term->bot) return;
+	n = min(n, term->bot - top);
+	memmove(
+		cell(top + n, 0), cell(top, 0),
+		sizeof(struct Cell) * term->cols * (term->bot - top - n)
+	);
+	erase(cell(top, 0), cell(top + n, 0));
+}
+
+static void termReset(void) {
+	term->y = term->x = 0;
+	term->top = 0;
+	term->bot = term->rows;
+	term->style = Default;
+	term->save.y = term->save.x = 0;
+	term->save.style = Default;
+	term->insert = term->keypad = term->special = false;
+	for (uint i = 0; i < ModesLen; ++i) {
+		term->modes[i] = (i == ModeWrap || i == ModeCursor);
+	}
+	erase(cell(0, 0), cell(term->rows, 0));
+}
+
+static struct Cell *cellsResize(
+	struct Cell *old, uint rows, uint cols, uint shift
+) {
+	struct Cell *cells = calloc(rows * cols, sizeof(*cells));
+	if (!cells) err(EX_OSERR, "calloc");
+	for (uint i = 0; i < rows * cols; ++i) {
+		cells[i] = (struct Cell) { .style = Default, .ch = L' ' };
+	}
+	for (uint y = 0; old && y < rows && y + shift < term->rows; ++y) {
+		memcpy(
+			&cells[y * cols], &old[(y + shift) * term->cols],
+			sizeof(*cells) * min(cols, term->cols)
+		);
+	}
+	free(old);
+	return cells;
+}
+
+// Resize the screen, keeping the cursor's row in view.
+static void termResize(uint rows, uint cols) {
+	if (!rows || !cols) return;
+	if (rows == term->rows && cols == term->cols) return;
+	uint shift = (term->y >= rows ? term->y - rows + 1 : 0);
+	term->cells = cellsResize(term->cells, rows, cols, shift);
+	term->other = cellsResize(term->other, rows, cols, shift);
+	term->rows = rows;
+	term->cols = cols;
+	term->y = min(term->y - shift, rows - 1);
+	term->x = min(term->x, cols);
+	term->save.y = min(term->save.y, rows - 1);
+	term->save.x = min(term->save.x, cols - 1);
+	term->top = 0;
+	term->bot = rows;
+}
+
+static void termInit(uint rows, uint cols, uint lines) {
+	termResize((rows ? rows : 24), (cols ? cols : 80));
+	termReset();
+	term->hist.cap = lines;
+	if (!term->hist.cap) return;
+	term->hist.lines = calloc(term->hist.cap, sizeof(*term->hist.lines));
+	if (!term->hist.lines) err(EX_OSERR, "calloc");
+}
+
+static void termFree(void) {
+	free(term->cells);
+	free(term->other);
+	for (uint i = 0; i < term->hist.len; ++i) {
+		free(term->hist.lines[(term->hist.head + i) % term->hist.cap]);
+	}
+	free(term->hist.lines);
+}
+
+static void nl(void) {
+	if (term->y + 1 == term->bot) {
+		scrollUp(term->top, 1);
+	} else if (term->y + 1 < term->rows) {
+		term->y++;
+	}
+}
+
+static void ri(void) {
+	if (term->y == term->top) {
+		scrollDown(term->top, 1);
+	} else if (term->y) {
+		term->y--;
+	}
+}
+
+static const wchar_t AltCharset[128] = {
+	['`'] = L'◆', ['a'] = L'▒', ['f'] = L'°', ['g'] = L'±', ['i'] = L'␋',
+	['j'] = L'┘', ['k'] = L'┐', ['l'] = L'┌', ['m'] = L'└', ['n'] = L'┼',
+	['q'] = L'─', ['t'] = L'├', ['u'] = L'┤', ['v'] = L'┴', ['w'] = L'┬',
+	['x'] = L'│', ['y'] = L'≤', ['z'] = L'≥', ['{'] = L'π', ['|'] = L'≠',
+	['}'] = L'£', ['~'] = L'·',
+};
+
+static void combine(wchar_t ch) {
+	uint x = term->x;
+	while (x && !cell(term->y, x - 1)->ch) x--;
+	if (!x) return;
+	struct Cell *prev = cell(term->y, x - 1);
+	for (uint i = 0; i < CombiningCap; ++i) {
+		if (prev->combining[i]) continue;
+		prev->combining[i] = ch;
+		return;
+	}
+}
+
+static void add(wchar_t ch) {
+	if (term->special && ch < 128 && AltCharset[ch]) ch = AltCharset[ch];
+	int width = wcwidth(ch);
+	if (width < 0) return;
+	if (!width) {
+		combine(ch);
+		return;
+	}
+	if (term->x + width > term->cols) {
+		if (term->modes[ModeWrap]) {
+			term->x = 0;
+			nl();
+		} else {
+			term->x = term->cols - min(width, term->cols);
+		}
+	}
+	if (term->insert) {
+		uint n = min(width, term->cols - term->x);
+		memmove(
+			cell(term->y, term->x + n), cell(term->y, term->x),
+			sizeof(struct Cell) * (term->cols - term->x - n)
+		);
+	}
+	*cell(term->y, term->x) = (struct Cell) { .style = term->style, .ch = ch };
+	for (int i = 1; i < width && term->x + i < term->cols; ++i) {
+		*cell(term->y, term->x + i) = (struct Cell) {
+			.style = term->style, .ch = L'\0'
+		};
+	}
+	term->x = min(term->x + width, term->cols);
+	if (!term->modes[ModeWrap]) term->x = min(term->x, term->cols - 1);
+}
+
+static uint p(uint i, uint z) {
+	return (i < term->param.n && term->param.s[i] ? term->param.s[i] : z);
+}
+
+static int sgrColor(uint *i, int color) {
+	if (*i + 1 >= term->param.n) return color;
+	if (term->param.s[*i + 1] == 5 && *i + 2 < term->param.n) {
+		*i += 2;
+		return min(term->param.s[*i], 255);
+	}
+	if (term->param.s[*i + 1] == 2 && *i + 4 < term->param.n) {
+		*i += 4;
+		return TrueColor
+			| min(term->param.s[*i - 2], 255) << 16
+			| min(term->param.s[*i - 1], 255) << 8
+			| min(term->param.s[*i], 255);
+	}
+	*i = term->param.n;
+	return color;
+}
+
+static void sgr(void) {
+	if (!term->param.n) term->param.n = 1;
+	for (uint i = 0; i < term->param.n; ++i) {
+		uint n = term->param.s[i];
+		switch (n) {
+			break; case 0: term->style = Default;
+			break; case 1: term->style.attr |= Bold;
+			break; case 2: term->style.attr |= Dim;
+			break; case 3: term->style.attr |= Italic;
+			break; case 4: term->style.attr |= Underline;
+			break; case 5: term->style.attr |= Blink;
+			break; case 7: term->style.attr |= Reverse;
+			break; case 8: term->style.attr |= Invisible;
+			break; case 9: term->style.attr |= Strike;
+			break; case 21: term->style.attr &= ~Bold;
+			break; case 22: term->style.attr &= ~(Bold | Dim);
+			break; case 23: term->style.attr &= ~Italic;
+			break; case 24: term->style.attr &= ~Underline;
+			break; case 25: term->style.attr &= ~Blink;
+			break; case 27: term->style.attr &= ~Reverse;
+			break; case 28: term->style.attr &= ~Invisible;
+			break; case 29: term->style.attr &= ~Strike;
+			break; case 30 ... 37: term->style.fg = n - 30;
+			break; case 38: term->style.fg = sgrColor(&i, term->style.fg);
+			break; case 39: term->style.fg = -1;
+			break; case 40 ... 47: term->style.bg = n - 40;
+			break; case 48: term->style.bg = sgrColor(&i, term->style.bg);
+			break; case 49: term->style.bg = -1;
+			break; case 90 ... 97: term->style.fg = n - 90 + 8;
+			break; case 100 ... 107: term->style.bg = n - 100 + 8;
+		}
+	}
+}
+
+static void decMode(bool set) {
+	for (uint i = 0; i < term->param.n; ++i) {
+		uint n = term->param.s[i];
+		if (n == 47 || n == 1047 || n == 1049) {
+			if (set == term->alt) continue;
+			if (n == 1049 && set) {
+				term->save.y = term->y;
+				term->save.x = term->x;
+				term->save.style = term->style;
+			}
+			struct Cell *swap = term->cells;
+			term->cells = term->other;
+			term->other = swap;
+			term->alt = set;
+			if (set) erase(cell(0, 0), cell(term->rows, 0));
+			if (n == 1049 && !set) {
+				term->y = term->save.y;
+				term->x = term->save.x;
+				term->style = term->save.style;
+			}
+			continue;
+		}
+		for (uint j = 0; j < ModesLen; ++j) {
+			if (Modes[j] == n) term->modes[j] = set;
+		}
+	}
+}
+
+static void csi(wchar_t ch) {
+	if (term->param.inter) return;
+	if (term->param.private == '?') {
+		if (ch == L'h') decMode(true);
+		if (ch == L'l') decMode(false);
+		return;
+	}
+	if (term->param.private) return;
+	uint rows = term->rows, cols = term->cols;
+	uint n = p(0, 1);
+	switch (ch) {
+		break; case L'@': {
+			n = min(n, cols - min(term->x, cols));
+			memmove(
+				cell(term->y, term->x + n), cell(term->y, term->x),
+				sizeof(struct Cell) * (cols - term->x - n)
+			);
+			erase(cell(term->y, term->x), cell(term->y, term->x + n));
+		}
+		break; case L'A': term->y -= min(n, term->y);
+		break; case L'B': term->y = min(term->y + n, rows - 1);
+		break; case L'C': term->x = min(term->x + n, cols - 1);
+		break; case L'D': term->x -= min(n, term->x);
+		break; case L'E': {
+			term->x = 0;
+			term->y = min(term->y + n, rows - 1);
+		}
+		break; case L'F': {
+			term->x = 0;
+			term->y -= min(n, term->y);
+		}
+		break; case L'G': term->x = min(n - 1, cols - 1);
+		break; case L'H': case L'f': {
+			term->y = min(n - 1, rows - 1);
+			term->x = min(p(1, 1) - 1, cols - 1);
+		}
+		break; case L'J': {
+			uint mode = (term->param.n ? term->param.s[0] : 0);
+			if (mode == 0) {
+				erase(cell(term->y, min(term->x, cols)), cell(rows, 0));
+			} else if (mode == 1) {
+				erase(cell(0, 0), cell(term->y, min(term->x + 1, cols)));
+			} else {
+				erase(cell(0, 0), cell(rows, 0));
+			}
+		}
+		break; case L'K': {
+			uint mode = (term->param.n ? term->param.s[0] : 0);
+			uint x = min(term->x, cols);
+			erase(
+				cell(term->y, (mode == 0 ? x : 0)),
+				cell(term->y, (mode == 1 ? min(x + 1, cols) : cols))
+			);
+		}
+		break; case L'L': {
+			if (term->y >= term->top && term->y < term->bot) {
+				scrollDown(term->y, n);
+			}
+		}
+		break; case L'M': {
+			if (term->y >= term->top && term->y < term->bot) {
+				scrollUp(term->y, n);
+			}
+		}
+		break; case L'P': {
+			n = min(n, cols - min(term->x, cols));
+			memmove(
+				cell(term->y, term->x), cell(term->y, term->x + n),
+				sizeof(struct Cell) * (cols - term->x - n)
+			);
+			erase(cell(term->y, cols - n), cell(term->y, cols));
+		}
+		break; case L'S': scrollUp(term->top, n);
+		break; case L'T': scrollDown(term->top, n);
+		break; case L'X': {
+			uint x = min(term->x, cols);
+			erase(cell(term->y, x), cell(term->y, min(x + n, cols)));
+		}
+		break; case L'd': term->y = min(n - 1, rows - 1);
+		break; case L'h': if (p(0, 0) == 4) term->insert = true;
+		break; case L'l': if (p(0, 0) == 4) term->insert = false;
+		break; case L'm': sgr();
+		break; case L'r': {
+			uint top = n - 1;
+			uint bot = min(p(1, rows), rows);
+			if (top + 1 >= bot) break;
+			term->top = top;
+			term->bot = bot;
+			term->y = term->x = 0;
+		}
+		break; case L's': {
+			term->save.y = term->y;
+			term->save.x = term->x;
+		}
+		break; case L'u': {
+			term->y = term->save.y;
+			term->x = term->save.x;
+		}
+	}
+}
+
+static void esc(wchar_t ch) {
+	term->state = Data;
+	switch (ch) {
+		break; case L'7': {
+			term->save.y = term->y;
+			term->save.x = term->x;
+			term->save.style = term->style;
+		}
+		break; case L'8': {
+			term->y = term->save.y;
+			term->x = term->save.x;
+			term->style = term->save.style;
+		}
+		break; case L'=': term->keypad = true;
+		break; case L'>': term->keypad = false;
+		break; case L'D': nl();
+		break; case L'E': {
+			term->x = 0;
+			nl();
+		}
+		break; case L'M': ri();
+		break; case L'c': termReset();
+		break; case L'[': {
+			memset(&term->param, 0, sizeof(term->param));
+			term->state = CSI;
+		}
+		break; case L']': case L'P': case L'^': case L'_': case L'X': {
+			term->state = String;
+		}
+		break; case L'(': case L')': case L'*': case L'+': case L'#': {
+			term->param.inter = ch;
+			term->state = EscInter;
+		}
+	}
+}
+
+static void update(wchar_t ch) {
+	switch (term->state) {
+		break; case Data: {
+			switch (ch) {
+				break; case L'\b': if (term->x) term->x--;
+				break; case L'\t': {
+					term->x = min(term->x - term->x % 8 + 8, term->cols - 1);
+				}
+				break; case L'\n': case L'\v': case L'\f': nl();
+				break; case L'\r': term->x = 0;
+				break; case L'\33': term->state = Esc;
+				break; default: if (ch >= L' ' && ch != 0x7F) add(ch);
+			}
+		}
+		break; case Esc: esc(ch);
+		break; case EscInter: {
+			if (term->param.inter == '(') term->special = (ch == L'0');
+			term->param.inter = 0;
+			term->state = Data;
+		}
+		break; case CSI: {
+			if (ch >= L'0' && ch <= L'9') {
+				if (!term->param.n) term->param.n = 1;
+				uint *s = &term->param.s[term->param.n - 1];
+				*s = min(10 * *s + ch - L'0', 0xFFFF);
+			} else if (ch == L';' || ch == L':') {
+				if (!term->param.n) term->param.n = 1;
+				if (term->param.n < ParamCap) term->param.n++;
+			} else if (ch >= L'<' && ch <= L'?') {
+				term->param.private = ch;
+			} else if (ch >= L' ' && ch <= L'/') {
+				term->param.inter = ch;
+			} else if (ch >= L'@' && ch <= L'~') {
+				csi(ch);
+				term->state = Data;
+			} else if (ch == L'\33') {
+				term->state = Esc;
+			} else if (ch == L'\30' || ch == L'\32') {
+				term->state = Data;
+			}
+		}
+		break; case String: {
+			if (ch == L'\a') term->state = Data;
+			if (ch == L'\33') term->state = StringEsc;
+		}
+		break; case StringEsc: {
+			if (ch == L'\\') {
+				term->state = Data;
+			} else {
+				esc(ch);
+			}
+		}
+	}
+}
+
+static void termUpdate(const char *ptr, size_t len) {
+	while (len) {
+		wchar_t ch;
+		size_t n = mbrtowc(&ch, ptr, len, &term->mbs);
+		if (n == (size_t)-2) break;
+		if (n == (size_t)-1) {
+			memset(&term->mbs, 0, sizeof(term->mbs));
+			ch = L'\uFFFD';
+			n = 1;
+		}
+		if (!n) n = 1;
+		update(ch);
+		ptr += n;
+		len -= n;
+	}
+}
+
+struct Buffer {
+	char *ptr;
+	size_t len, cap;
+};
+
+static void bufferPut(struct Buffer *buf, const char *ptr, size_t len) {
+	if (buf->len + len > buf->cap) {
+		if (!buf->cap) buf->cap = 4096;
+		while (buf->len + len > buf->cap) buf->cap *= 2;
+		buf->ptr = realloc(buf->ptr, buf->cap);
+		if (!buf->ptr) err(EX_OSERR, "realloc");
+	}
+	memcpy(&buf->ptr[buf->len], ptr, len);
+	buf->len += len;
+}
+
+static void bufferFormat(struct Buffer *buf, const char *format, ...) {
+	char str[64];
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(str, sizeof(str), format, ap);
+	va_end(ap);
+	bufferPut(buf, str, min(len, sizeof(str) - 1));
+}
+
+static void bufferChar(struct Buffer *buf, wchar_t ch) {
+	char str[MB_LEN_MAX];
+	mbstate_t mbs = {0};
+	size_t len = wcrtomb(str, ch, &mbs);
+	if (len == (size_t)-1) {
+		bufferPut(buf, "?", 1);
+	} else {
+		bufferPut(buf, str, len);
+	}
+}
+
+static void sgrColorOut(struct Buffer *buf, int color, uint base) {
+	if (color < 0) return;
+	if (color & TrueColor) {
+		bufferFormat(
+			buf, ";%u;2;%u;%u;%u", base + 8,
+			color >> 16 & 0xFF, color >> 8 & 0xFF, color & 0xFF
+		);
+	} else if (color < 8) {
+		bufferFormat(buf, ";%u", base + color);
+	} else if (color < 16) {
+		bufferFormat(buf, ";%u", base + 60 + color - 8);
+	} else {
+		bufferFormat(buf, ";%u;5;%u", base + 8, color);
+	}
+}
+
+static void sgrOut(struct Buffer *buf, struct Style style) {
+	// Parameters for each attribute bit in order.
+	static const char Params[] = "12345789";
+	bufferPut(buf, "\33[0", 3);
+	for (uint i = 0; i < sizeof(Params) - 1; ++i) {
+		if (!(style.attr & 1 << i)) continue;
+		bufferFormat(buf, ";%c", Params[i]);
+	}
+	sgrColorOut(buf, style.fg, 30);
+	sgrColorOut(buf, style.bg, 40);
+	bufferPut(buf, "m", 1);
+}
+
+static bool styleEqual(struct Style a, struct Style b) {
+	return a.attr == b.attr && a.fg == b.fg && a.bg == b.bg;
+}
+
+// Output a row of cells, leaving off trailing blanks of the default style.
+static void rowOut(struct Buffer *buf, const struct Cell *cells, uint len) {
+	while (
+		len && cells[len - 1].ch == L' ' &&
+		styleEqual(cells[len - 1].style, Default)
+	) len--;
+	struct Style style = Default;
+	for (uint x = 0; x < len; ++x) {
+		if (!cells[x].ch) continue;
+		if (!styleEqual(cells[x].style, style)) {
+			style = cells[x].style;
+			sgrOut(buf, style);
+		}
+		bufferChar(buf, cells[x].ch);
+		for (uint i = 0; i < CombiningCap && cells[x].combining[i]; ++i) {
+			bufferChar(buf, cells[x].combining[i]);
+		}
+	}
+	if (!styleEqual(style, Default)) sgrOut(buf, Default);
+}
+
+// Synthesize a stream which reproduces the screen on a reset terminal,
+// preceded by any history, which is scrolled out of view.
+static void redraw(struct Buffer *buf, bool history) {
+	bufferFormat(buf, "\33c");
+	if (history && !term->alt && term->hist.len) {
+		for (uint i = 0; i < term->hist.len; ++i) {
+			const struct Line *line =
+				term->hist.lines[(term->hist.head + i) % term->hist.cap];
+			rowOut(buf, line->cells, min(line->len, term->cols));
+			bufferPut(buf, "\r\n", 2);
+		}
+		bufferFormat(buf, "\33[%uH", term->rows);
+		for (uint i = min(term->hist.len, term->rows - 1); i; --i) {
+			bufferPut(buf, "\n", 1);
+		}
+	}
+	if (term->alt) bufferFormat(buf, "\33[?1049h");
+	for (uint y = 0; y < term->rows; ++y) {
+		bufferFormat(buf, "\33[%uH", y + 1);
+		rowOut(buf, cell(y, 0), term->cols);
+	}
+	if (term->top || term->bot != term->rows) {
+		bufferFormat(buf, "\33[%u;%ur", term->top + 1, term->bot);
+	}
+	bufferFormat(
+		buf, "\33[%u;%uH", term->y + 1, min(term->x, term->cols - 1) + 1
+	);
+	sgrOut(buf, term->style);
+	for (uint i = 0; i < ModesLen; ++i) {
+		bool set = (i == ModeWrap || i == ModeCursor);
+		if (term->modes[i] == set) continue;
+		bufferFormat(buf, "\33[?%u%c", Modes[i], (term->modes[i] ? 'h' : 'l'));
+	}
+	if (term->insert) bufferFormat(buf, "\33[4h");
+	if (term->keypad) bufferFormat(buf, "\33=");
+	if (term->special) bufferFormat(buf, "\33(0");
+}
+
+// In fan-out mode, the PTY is read once into a ring buffer, which each
+// client is sent from its own position.
+enum { RingSize = 256 * 1024 };
+
+// A session in fan-out mode, either alone in its own process or one of
+// many run by the daemon.
+struct Session {
+	char path[sizeof(addr.sun_path)];
+	pid_t pid;
+	int server, pty;
+	bool dead;
+	struct Term term;
+	struct {
+		char buf[RingSize];
+		size_t head;
+	} ring;
+};
+
+static struct Session **sessions;
+static size_t nsessions;
+
 static void handler(int sig) {
 	unlink(addr.sun_path);
+	for (size_t i = 0; i < nsessions; ++i) {
+		unlink(sessions[i]->path);
+	}
 	_exit(-sig);
 }
 
-static void detach(int server, bool sink, char *argv[]) {
-	int pty;
-	pid_t pid = forkpty(&pty, NULL, NULL, NULL);
-	if (pid < 0) err(EX_OSERR, "forkpty");
+static void nop(int sig) {
+	(void)sig;
+}
+
+static pid_t spawn(int *pty, const char *cwd, char *argv[]) {
+	pid_t pid = forkpty(pty, NULL, NULL, NULL);
+	if (pid < 0) return pid;
 
 	if (!pid) {
+		signal(SIGPIPE, SIG_DFL);
+		if (cwd && chdir(cwd)) err(EX_NOINPUT, "%s", cwd);
 		execvp(argv[0], argv);
 		err(EX_NOINPUT, "%s", argv[0]);
 	}
 
+	fcntl(*pty, F_SETFD, FD_CLOEXEC);
+	return pid;
+}
+
+// Returns NULL, leaving the caller to clean up, if the session cannot be
+// added.
+static struct Session *sessionAdd(
+	const char *path, int server, int pty, pid_t pid, uint lines
+) {
+	struct winsize window;
+	int error = ioctl(pty, TIOCGWINSZ, &window);
+	if (error) {
+		warn("%s: ioctl", path);
+		return NULL;
+	}
+
+	struct Session *session = calloc(1, sizeof(*session));
+	if (!session) err(EX_OSERR, "calloc");
+	snprintf(session->path, sizeof(session->path), "%s", path);
+	session->pid = pid;
+	session->server = server;
+	session->pty = pty;
+	fcntl(server, F_SETFL, O_NONBLOCK);
+
+	term = &session->term;
+	termInit(window.ws_row, window.ws_col, lines);
+
+	sessions = realloc(sessions, sizeof(*sessions) * (nsessions + 1));
+	if (!sessions) err(EX_OSERR, "realloc");
+	sessions[nsessions++] = session;
+	return session;
+}
+
+static void sessionRemove(size_t i) {
+	struct Session *session = sessions[i];
+	unlink(session->path);
+	close(session->server);
+	close(session->pty);
+	term = &session->term;
+	termFree();
+	free(session);
+	nsessions--;
+	memmove(
+		&sessions[i], &sessions[i + 1],
+		sizeof(*sessions) * (nsessions - i)
+	);
+}
+
+static struct Session *sessionFind(const char *name) {
+	for (size_t i = 0; i < nsessions; ++i) {
+		const char *base = strrchr(sessions[i]->path, '/');
+		if (!strcmp(&base[1], name)) return sessions[i];
+	}
+	return NULL;
+}
+
+// Clients send a byte once they have set the window size, asking to be
+// redrawn, with history on first attach.
+enum { Attach = 'a', Resize = 'r' };
+
+// Clients of the control socket have no session. They send a request of
+// NUL-terminated fields, shut down writing, and are sent a reply starting
+// with an exit status byte.
+enum { RequestCap = 64 * 1024 };
+
+static struct Client {
+	int fd;
+	struct Session *session;
+	size_t cursor;
+	struct Buffer out;
+	size_t sent;
+	struct Buffer request;
+	bool reply;
+} *clients;
+static size_t nclients;
+
+static void clientAdd(int fd, struct Session *session) {
+	if (session) {
+		ssize_t len = sendfd(fd, session->pty, Fanout);
+		if (len < 0) {
+			warn("sendfd");
+			close(fd);
+			return;
+		}
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	clients = realloc(clients, sizeof(*clients) * (nclients + 1));
+	if (!clients) err(EX_OSERR, "realloc");
+	clients[nclients++] = (struct Client) {
+		.fd = fd,
+		.session = session,
+		.cursor = (session ? session->ring.head : 0),
+	};
+}
+
+static void clientRemove(size_t i) {
+	close(clients[i].fd);
+	free(clients[i].out.ptr);
+	free(clients[i].request.ptr);
+	clients[i] = clients[--nclients];
+}
+
+// Replace anything a client has yet to be sent with a redraw.
+static void clientRedraw(size_t i, bool history) {
+	struct Client *client = &clients[i];
+	client->out.len = 0;
+	client->sent = 0;
+	term = &client->session->term;
+	redraw(&client->out, history);
+	client->cursor = client->session->ring.head;
+}
+
+static bool clientSend(size_t i, const char *ptr, size_t len, size_t *sent) {
+	while (len) {
+		ssize_t n = send(clients[i].fd, ptr, len, 0);
+		if (n < 0) return false;
+		ptr += n;
+		len -= n;
+		*sent += n;
+	}
+	return true;
+}
+
+// Send a client as much as it will take without blocking. A client which
+// has fallen further behind than the ring holds is redrawn instead, so
+// that a slow client never holds up the PTY.
+static bool clientWrite(size_t i) {
+	struct Client *client = &clients[i];
+	struct Session *session = client->session;
+	if (session && session->ring.head - client->cursor > RingSize) {
+		clientRedraw(i, false);
+	}
+	if (client->sent < client->out.len) {
+		bool done = clientSend(
+			i, &client->out.ptr[client->sent],
+			client->out.len - client->sent, &client->sent
+		);
+		if (!done) return (errno == EAGAIN || errno == EWOULDBLOCK);
+		client->out.len = client->sent = 0;
+	}
+	if (!session) return !client->reply;
+	while (client->cursor < session->ring.head) {
+		size_t at = client->cursor % RingSize;
+		size_t len = min(session->ring.head - client->cursor, RingSize - at);
+		bool done = clientSend(
+			i, &session->ring.buf[at], len, &client->cursor
+		);
+		if (!done) return (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+	return true;
+}
+
+static void replyPut(struct Buffer *out, char status, const char *msg) {
+	bufferPut(out, &status, 1);
+	bufferPut(out, msg, strlen(msg));
+}
+
+static void controlNew(struct Buffer *out, char *argv[], uint lines) {
+	const char *name = argv[0];
+	const char *cwd = (name ? argv[1] : NULL);
+	if (!cwd || !argv[2]) {
+		replyPut(out, EX_USAGE, "invalid request");
+		return;
+	}
+	if (!name[0] || name[0] == '.' || strchr(name, '/')) {
+		replyPut(out, EX_USAGE, "invalid session name");
+		return;
+	}
+
+	// Session sockets live beside the control socket.
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int dir = strrchr(addr.sun_path, '/') - addr.sun_path;
+	int len = snprintf(
+		sun.sun_path, sizeof(sun.sun_path), "%.*s/%s",
+		dir, addr.sun_path, name
+	);
+	if ((size_t)len >= sizeof(sun.sun_path)) {
+		replyPut(out, EX_USAGE, "session name too long");
+		return;
+	}
+
+	int server = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) {
+		replyPut(out, EX_OSERR, strerror(errno));
+		return;
+	}
+	fcntl(server, F_SETFD, FD_CLOEXEC);
+
+	int error = bind(server, (struct sockaddr *)&sun, SUN_LEN(&sun));
+	if (error) {
+		replyPut(out, EX_CANTCREAT, strerror(errno));
+		close(server);
+		return;
+	}
+	error = listen(server, SOMAXCONN);
+	if (error) {
+		replyPut(out, EX_OSERR, strerror(errno));
+		goto fail;
+	}
+
+	int pty;
+	pid_t pid = spawn(&pty, cwd, &argv[2]);
+	if (pid < 0) {
+		replyPut(out, EX_OSERR, strerror(errno));
+		goto fail;
+	}
+	if (!sessionAdd(sun.sun_path, server, pty, pid, lines)) {
+		replyPut(out, EX_IOERR, "cannot add session");
+		kill(pid, SIGHUP);
+		close(pty);
+		goto fail;
+	}
+	replyPut(out, EX_OK, "");
+	return;
+
+fail:
+	unlink(sun.sun_path);
+	close(server);
+}
+
+static void controlKill(struct Buffer *out, const char *name) {
+	struct Session *session = (name ? sessionFind(name) : NULL);
+	if (!session) {
+		replyPut(out, EX_NOINPUT, "no such session");
+		return;
+	}
+	kill(session->pid, SIGHUP);
+	replyPut(out, EX_OK, "");
+}
+
+static void controlList(struct Buffer *out) {
+	replyPut(out, EX_OK, "");
+	for (size_t i = 0; i < nsessions; ++i) {
+		size_t n = 0;
+		for (size_t j = 0; j < nclients; ++j) {
+			if (clients[j].session == sessions[i]) n++;
+		}
+		const char *name = &strrchr(sessions[i]->path, '/')[1];
+		bufferPut(out, name, strlen(name));
+		bufferFormat(out, "\t%ld\t%zu\n", (long)sessions[i]->pid, n);
+	}
+}
+
+static void controlRequest(struct Client *client, uint lines) {
+	struct Buffer *req = &client->request;
+	size_t argc = 0;
+	for (size_t i = 0; i < req->len; ++i) {
+		if (!req->ptr[i]) argc++;
+	}
+	char *argv[argc + 1];
+	for (size_t i = 0, j = 0; i < argc; ++i) {
+		argv[i] = &req->ptr[j];
+		j += strlen(argv[i]) + 1;
+	}
+	argv[argc] = NULL;
+
+	client->reply = true;
+	if (!argc || req->ptr[req->len - 1]) {
+		replyPut(&client->out, EX_USAGE, "invalid request");
+	} else if (!strcmp(argv[0], "list")) {
+		controlList(&client->out);
+	} else if (!strcmp(argv[0], "new")) {
+		controlNew(&client->out, &argv[1], lines);
+	} else if (!strcmp(argv[0], "kill")) {
+		controlKill(&client->out, argv[1]);
+	} else {
+		replyPut(&client->out, EX_USAGE, "invalid request");
+	}
+}
+
+static void clientRead(size_t i, uint lines) {
+	struct Client *client = &clients[i];
+	char buf[4096];
+	ssize_t len = recv(client->fd, buf, sizeof(buf), 0);
+	if (len < 0 && errno == EAGAIN) return;
+	if (len < 0 || (!len && (client->session || client->reply))) {
+		clientRemove(i);
+		return;
+	}
+
+	if (!client->session) {
+		if (client->reply) return;
+		if (!len) {
+			controlRequest(client, lines);
+		} else if (client->request.len + len > RequestCap) {
+			clientRemove(i);
+		} else {
+			bufferPut(&client->request, buf, len);
+		}
+		return;
+	}
+
+	struct winsize window;
+	int error = ioctl(client->session->pty, TIOCGWINSZ, &window);
+	if (error) {
+		warn("%s: ioctl", client->session->path);
+		clientRemove(i);
+		return;
+	}
+	term = &client->session->term;
+	termResize(window.ws_row, window.ws_col);
+	clientRedraw(i, memchr(buf, Attach, len));
+}
+
+// Serve the sessions and their clients, and the control socket if any.
+// Without the control socket, the process exits with its one session.
+static void serve(int control, uint lines) {
+	signal(SIGPIPE, SIG_IGN);
+	if (control >= 0) signal(SIGCHLD, nop);
+
+	struct pollfd *fds = NULL;
+	size_t cap = 0;
+	for (;;) {
+		size_t len = 1 + 2 * nsessions + nclients;
+		if (len > cap) {
+			cap = len * 2;
+			fds = realloc(fds, sizeof(*fds) * cap);
+			if (!fds) err(EX_OSERR, "realloc");
+		}
+
+		size_t polledSessions = nsessions;
+		size_t polledClients = nclients;
+		struct pollfd *fd = fds;
+		*fd++ = (struct pollfd) { .events = POLLIN, .fd = control };
+		for (size_t i = 0; i < nsessions; ++i) {
+			struct Session *session = sessions[i];
+			*fd++ = (struct pollfd) { .events = POLLIN, .fd = session->server };
+			*fd++ = (struct pollfd) { .events = POLLIN, .fd = session->pty };
+		}
+		struct pollfd *conns = fd;
+		for (size_t i = 0; i < nclients; ++i) {
+			struct Client *client = &clients[i];
+			struct Session *session = client->session;
+			bool more = (
+				client->out.len ||
+				(session && client->cursor < session->ring.head)
+			);
+			*fd = (struct pollfd) { .fd = client->fd };
+			if (!client->reply) fd->events |= POLLIN;
+			if (more) fd->events |= POLLOUT;
+			fd++;
+		}
+
+		int nfds = poll(fds, fd - fds, -1);
+		if (nfds < 0 && errno != EINTR) err(EX_IOERR, "poll");
+
+		if (nfds > 0 && fds[0].revents) {
+			int client = accept(control, NULL, NULL);
+			if (client >= 0) clientAdd(client, NULL);
+		}
+
+		for (size_t i = 0; nfds > 0 && i < polledSessions; ++i) {
+			struct Session *session = sessions[i];
+			if (fds[1 + 2 * i].revents) {
+				int client = accept(session->server, NULL, NULL);
+				if (client >= 0) clientAdd(client, session);
+			}
+			if (!fds[2 + 2 * i].revents) continue;
+			size_t at = session->ring.head % RingSize;
+			char *ptr = &session->ring.buf[at];
+			ssize_t len = read(session->pty, ptr, RingSize - at);
+			// Once the last process closes the PTY, the child is exiting.
+			// On any other error, the session is closed.
+			if (len < 0 && errno != EIO) {
+				warn("%s: read", session->path);
+				kill(session->pid, SIGHUP);
+			}
+			if (len <= 0) {
+				if (control < 0) reap(session->pid, 0);
+				session->dead = true;
+				continue;
+			}
+			term = &session->term;
+			termUpdate(ptr, len);
+			session->ring.head += len;
+		}
+
+		for (size_t i = nclients - 1; i < nclients; --i) {
+			struct Client *client = &clients[i];
+			if (client->session && client->session->dead) {
+				clientRemove(i);
+				continue;
+			}
+			if (nfds > 0 && i < polledClients && conns[i].revents) {
+				size_t n = nclients;
+				clientRead(i, lines);
+				if (nclients < n) continue;
+			}
+			if (!clientWrite(i)) clientRemove(i);
+		}
+
+		for (size_t i = nsessions - 1; i < nsessions; --i) {
+			if (sessions[i]->dead) sessionRemove(i);
+		}
+
+		if (control < 0) {
+			reap(sessions[0]->pid, WNOHANG);
+		} else {
+			while (0 < waitpid(-1, NULL, WNOHANG));
+		}
+	}
+}
+
+static void detach(
+	int server, bool sink, bool multi, uint lines, char *argv[]
+) {
+	int pty;
+	pid_t pid = spawn(&pty, NULL, argv);
+	if (pid < 0) err(EX_OSERR, "forkpty");
+
 	signal(SIGINT, handler);
 	signal(SIGTERM, handler);
 
-	int error = listen(server, 0);
+	int error = listen(server, (multi ? SOMAXCONN : 0));
 	if (error) err(EX_OSERR, "listen");
 
+	if (multi) {
+		if (!sessionAdd(addr.sun_path, server, pty, pid, lines)) {
+			exit(EX_IOERR);
+		}
+		serve(-1, lines);
+	}
+
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = server },
 		{ .events = POLLIN, .fd = pty },
@@ -113,7 +1285,7 @@ static void detach(int server, bool sink, char *argv[]) {
 			int client = accept(server, NULL, NULL);
 			if (client < 0) err(EX_IOERR, "accept");
 
-			ssize_t len = sendfd(client, pty);
+			ssize_t len = sendfd(client, pty, Direct);
 			if (len < 0) warn("sendfd");
 
 			len = recv(client, &_, sizeof(_), 0);
@@ -128,13 +1300,7 @@ static void detach(int server, bool sink, char *argv[]) {
 			if (len < 0) err(EX_IOERR, "read");
 		}
 
-		int status;
-		pid_t dead = waitpid(pid, &status, WNOHANG);
-		if (dead < 0) err(EX_OSERR, "waitpid");
-		if (dead) {
-			unlink(addr.sun_path);
-			exit(WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
-		}
+		reap(pid, WNOHANG);
 	}
 	err(EX_IOERR, "poll");
 }
@@ -146,28 +1312,92 @@ static void restoreTerm(void) {
 	warnx("detached");
 }
 
-static void nop(int sig) {
-	(void)sig;
+static void writeAll(int fd, const char *ptr, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0) err(EX_IOERR, "write");
+		ptr += n;
+		len -= n;
+	}
+}
+
+// Output to the terminal is buffered in a ring, which is filled by as
+// many reads as are ready and drained with writev as the terminal takes
+// it. While the ring is full, output is left unread, and a fan-out session
+// redraws the client once it falls far enough behind.
+enum { OutSize = 64 * 1024 };
+static struct {
+	char buf[OutSize];
+	size_t head, tail;
+} out;
+
+static int outVec(struct iovec iov[2], size_t from, size_t len) {
+	size_t at = from % OutSize;
+	iov[0].iov_base = &out.buf[at];
+	iov[0].iov_len = min(len, OutSize - at);
+	iov[1].iov_base = out.buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return (iov[1].iov_len ? 2 : 1);
+}
+
+// Read output until none is ready or the ring is full. Returns 0 on EOF.
+static ssize_t outRead(int fd) {
+	struct pollfd ready = { .events = POLLIN, .fd = fd };
+	ssize_t total = 0;
+	do {
+		struct iovec iov[2];
+		int n = outVec(iov, out.head, OutSize - (out.head - out.tail));
+		ssize_t len = readv(fd, iov, n);
+		if (len <= 0) return (total ? total : len);
+		out.head += len;
+		total += len;
+	} while (out.head - out.tail < OutSize && 0 < poll(&ready, 1, 0));
+	return total;
+}
+
+static void outWrite(void) {
+	struct iovec iov[2];
+	int n = outVec(iov, out.tail, out.head - out.tail);
+	ssize_t len = writev(STDOUT_FILENO, iov, n);
+	if (len < 0) err(EX_IOERR, "writev");
+	out.tail += len;
+}
+
+static void outFlush(void) {
+	int error = errno;
+	while (out.head != out.tail) outWrite();
+	errno = error;
 }
 
 static void attach(int client) {
 	int error;
 
-	int pty = recvfd(client);
+	char mode;
+	int pty = recvfd(client, &mode);
 	if (pty < 0) err(EX_IOERR, "recvfd");
+	int output = (mode == Fanout ? client : pty);
 	warnx("attached");
 
 	struct winsize window;
 	error = ioctl(STDIN_FILENO, TIOCGWINSZ, &window);
 	if (error) err(EX_IOERR, "ioctl");
 
-	struct winsize redraw = { .ws_row = 1, .ws_col = 1 };
-	error = ioctl(pty, TIOCSWINSZ, &redraw);
-	if (error) err(EX_IOERR, "ioctl");
+	// Without a redraw from the session, force the application to redraw.
+	if (mode != Fanout) {
+		struct winsize poke = { .ws_row = 1, .ws_col = 1 };
+		error = ioctl(pty, TIOCSWINSZ, &poke);
+		if (error) err(EX_IOERR, "ioctl");
+	}
 
 	error = ioctl(pty, TIOCSWINSZ, &window);
 	if (error) err(EX_IOERR, "ioctl");
 
+	if (mode == Fanout) {
+		char request = Attach;
+		ssize_t len = send(client, &request, 1, 0);
+		if (len < 0) err(EX_IOERR, "send");
+	}
+
 	error = tcgetattr(STDIN_FILENO, &saveTerm);
 	if (error) err(EX_IOERR, "tcgetattr");
 	atexit(restoreTerm);
@@ -182,10 +1412,13 @@ static void attach(int client) {
 	char buf[4096];
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = pty },
+		{ .events = POLLIN, .fd = output },
+		{ .events = POLLOUT, .fd = STDOUT_FILENO },
 	};
 	for (;;) {
-		int nfds = poll(fds, 2, -1);
+		fds[1].fd = (out.head - out.tail < OutSize ? output : -1);
+		fds[2].fd = (out.head != out.tail ? STDOUT_FILENO : -1);
+		int nfds = poll(fds, 3, -1);
 		if (nfds < 0) {
 			if (errno != EINTR) err(EX_IOERR, "poll");
 
@@ -195,6 +1428,11 @@ static void attach(int client) {
 			error = ioctl(pty, TIOCSWINSZ, &window);
 			if (error) err(EX_IOERR, "ioctl");
 
+			if (mode == Fanout) {
+				char request = Resize;
+				ssize_t len = send(client, &request, 1, 0);
+				if (len < 0) err(EX_IOERR, "send");
+			}
 			continue;
 		}
 
@@ -205,39 +1443,86 @@ static void attach(int client) {
 
 			if (len == 1 && buf[0] == CTRL('Q')) break;
 
-			len = write(pty, buf, len);
-			if (len < 0) err(EX_IOERR, "write");
+			writeAll(pty, buf, len);
 		}
 
 		if (fds[1].revents) {
-			ssize_t len = read(pty, buf, sizeof(buf));
-			if (len < 0) err(EX_IOERR, "read");
+			ssize_t len = outRead(output);
+			if (len < 0) {
+				outFlush();
+				err(EX_IOERR, "read");
+			}
 			if (!len) break;
+		}
 
-			len = write(STDOUT_FILENO, buf, len);
-			if (len < 0) err(EX_IOERR, "write");
+		if (fds[2].revents) outWrite();
+	}
+	outFlush();
+}
+
+// Send a request to the daemon and print its reply.
+static void request(int sock, const char *name, char *argv[]) {
+	for (; *argv; ++argv) {
+		const char *ptr = *argv;
+		size_t len = strlen(ptr) + 1;
+		while (len) {
+			ssize_t n = send(sock, ptr, len, 0);
+			if (n < 0) err(EX_IOERR, "send");
+			ptr += n;
+			len -= n;
 		}
 	}
+	int error = shutdown(sock, SHUT_WR);
+	if (error) err(EX_IOERR, "shutdown");
+
+	struct Buffer reply = {0};
+	char buf[4096];
+	ssize_t len;
+	while (0 < (len = recv(sock, buf, sizeof(buf), 0))) {
+		bufferPut(&reply, buf, len);
+	}
+	if (len < 0) err(EX_IOERR, "recv");
+	if (!reply.len) errx(EX_PROTOCOL, "no reply");
+
+	if (reply.ptr[0]) {
+		errx(
+			reply.ptr[0], "%s%s%.*s", (name ? name : ""), (name ? ": " : ""),
+			(int)reply.len - 1, &reply.ptr[1]
+		);
+	}
+	fwrite(&reply.ptr[1], reply.len - 1, 1, stdout);
 }
 
 int main(int argc, char *argv[]) {
+	setlocale(LC_CTYPE, "");
+
 	int error;
 
 	bool atch = false;
 	bool sink = false;
+	bool multi = false;
+	char ctl = 0;
+	uint lines = 0;
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "as"))) {
+	while (0 < (opt = getopt(argc, argv, "+H:adklmns"))) {
 		switch (opt) {
+			break; case 'H': lines = strtoul(optarg, NULL, 0);
 			break; case 'a': atch = true;
+			break; case 'm': multi = true;
 			break; case 's': sink = true;
+			break; case 'd': case 'k': case 'l': case 'n': ctl = opt;
 			break; default:  return EX_USAGE;
 		}
 	}
-	if (optind == argc) errx(EX_USAGE, "no session name");
-	const char *name = argv[optind++];
 
-	if (optind == argc) {
+	const char *name = NULL;
+	if (ctl != 'd' && ctl != 'l') {
+		if (optind == argc) errx(EX_USAGE, "no session name");
+		name = argv[optind++];
+	}
+
+	if ((!ctl || ctl == 'n') && optind == argc) {
 		argv[--optind] = getenv("SHELL");
 		if (!argv[optind]) errx(EX_CONFIG, "SHELL unset");
 	}
@@ -257,15 +1542,44 @@ int main(int argc, char *argv[]) {
 	if (sock < 0) err(EX_OSERR, "socket");
 	fcntl(sock, F_SETFD, FD_CLOEXEC);
 
-	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.dtch/%s", home, name);
+	snprintf(
+		addr.sun_path, sizeof(addr.sun_path), "%s/.dtch/%s",
+		home, (ctl ? ".control" : name)
+	);
 
-	if (atch) {
+	if (ctl == 'd') {
+		error = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+		if (error) err(EX_CANTCREAT, "%s", addr.sun_path);
+		error = listen(sock, SOMAXCONN);
+		if (error) err(EX_OSERR, "listen");
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		signal(SIGINT, handler);
+		signal(SIGTERM, handler);
+		serve(sock, lines);
+	} else if (ctl) {
+		error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+		if (error) err(EX_UNAVAILABLE, "%s", addr.sun_path);
+		char cwd[PATH_MAX];
+		if (ctl == 'n' && !getcwd(cwd, sizeof(cwd))) err(EX_OSERR, "getcwd");
+		char *req[argc + 4];
+		size_t n = 0;
+		if (ctl == 'l') req[n++] = "list";
+		if (ctl == 'k') req[n++] = "kill";
+		if (ctl == 'n') req[n++] = "new";
+		if (name) req[n++] = (char *)name;
+		if (ctl == 'n') {
+			req[n++] = cwd;
+			for (int i = optind; i < argc; ++i) req[n++] = argv[i];
+		}
+		req[n] = NULL;
+		request(sock, name, req);
+	} else if (atch) {
 		error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
 		if (error) err(EX_NOINPUT, "%s", addr.sun_path);
 		attach(sock);
 	} else {
 		error = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
 		if (error) err(EX_CANTCREAT, "%s", addr.sun_path);
-		detach(sock, sink, &argv[optind]);
+		detach(sock, sink, multi, lines, &argv[optind]);
 	}
 }
@@ -16,15 +16,24 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <locale.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
@@ -277,17 +286,58 @@ static const struct Syntax ShSyntax[] = {
 
 static const struct Language {
 	const char *name;
-	const char *pattern;
 	const struct Syntax *syntax;
 	size_t len;
 } Languages[] = {
-	{ "c",    "[.][chly]$", CSyntax, ARRAY_LEN(CSyntax) },
-	{ "diff", "[.](diff|patch)$", DiffSyntax, ARRAY_LEN(DiffSyntax) },
-	{ "make", "[.]mk$|^Makefile$", MakeSyntax, ARRAY_LEN(MakeSyntax) },
-	{ "mdoc", "[.][1-9]$", MdocSyntax, ARRAY_LEN(MdocSyntax) },
-	{ "rust", "[.]rs$", RustSyntax, ARRAY_LEN(RustSyntax) },
-	{ "sh",   "[.]sh$|^[.](profile|shrc)$", ShSyntax, ARRAY_LEN(ShSyntax) },
-	{ "text", "[.]txt$", NULL, 0 },
+	{ "c",    CSyntax, ARRAY_LEN(CSyntax) },
+	{ "diff", DiffSyntax, ARRAY_LEN(DiffSyntax) },
+	{ "make", MakeSyntax, ARRAY_LEN(MakeSyntax) },
+	{ "mdoc", MdocSyntax, ARRAY_LEN(MdocSyntax) },
+	{ "rust", RustSyntax, ARRAY_LEN(RustSyntax) },
+	{ "sh",   ShSyntax, ARRAY_LEN(ShSyntax) },
+	{ "text", NULL, 0 },
+};
+
+struct Match {
+	const char *name;
+	const char *lang;
+};
+
+// File names and extensions, sorted for bsearch(3).
+static const struct Match Names[] = {
+	{ ".1", "mdoc" },
+	{ ".2", "mdoc" },
+	{ ".3", "mdoc" },
+	{ ".4", "mdoc" },
+	{ ".5", "mdoc" },
+	{ ".6", "mdoc" },
+	{ ".7", "mdoc" },
+	{ ".8", "mdoc" },
+	{ ".9", "mdoc" },
+	{ ".c", "c" },
+	{ ".diff", "diff" },
+	{ ".h", "c" },
+	{ ".l", "c" },
+	{ ".mk", "make" },
+	{ ".patch", "diff" },
+	{ ".profile", "sh" },
+	{ ".rs", "rust" },
+	{ ".sh", "sh" },
+	{ ".shrc", "sh" },
+	{ ".txt", "text" },
+	{ ".y", "c" },
+	{ "Makefile", "make" },
+};
+
+// Interpreter names from #! lines, sorted for bsearch(3).
+static const struct Match Interpreters[] = {
+	{ "ash", "sh" },
+	{ "bash", "sh" },
+	{ "dash", "sh" },
+	{ "ksh", "sh" },
+	{ "make", "make" },
+	{ "mksh", "sh" },
+	{ "sh", "sh" },
 };
 
 static regex_t compile(const char *pattern, int flags) {
@@ -300,16 +350,21 @@ static regex_t compile(const char *pattern, int flags) {
 }
 
 enum { SubsLen = 8 };
-static void highlight(struct Language lang, enum Class *hi, const char *str) {
+static void
+highlight(struct Language lang, enum Class *hi, const char *str, size_t len) {
 	for (size_t i = 0; i < lang.len; ++i) {
 		struct Syntax syn = lang.syntax[i];
 		regex_t regex = compile(syn.pattern, syn.newline ? 0 : REG_NEWLINE);
 		assert(syn.subexp < SubsLen);
 		assert(syn.subexp <= regex.re_nsub);
 		regmatch_t subs[SubsLen] = {{0}};
-		for (size_t offset = 0; str[offset]; offset += subs[syn.subexp].rm_eo) {
+		for (size_t offset = 0; offset < len; offset += subs[syn.subexp].rm_eo) {
+			// Input is not NUL-terminated, so bound it with REG_STARTEND.
+			subs[0].rm_so = 0;
+			subs[0].rm_eo = len - offset;
 			int error = regexec(
-				&regex, &str[offset], SubsLen, subs, offset ? REG_NOTBOL : 0
+				&regex, &str[offset], SubsLen, subs,
+				REG_STARTEND | (offset ? REG_NOTBOL : 0)
 			);
 			if (error == REG_NOMATCH) break;
 			if (error) errx(EX_SOFTWARE, "regexec: %d", error);
@@ -326,13 +381,34 @@ static void highlight(struct Language lang, enum Class *hi, const char *str) {
 	}
 }
 
+static bool findLanguage(struct Language *lang, const char *name) {
+	for (size_t i = 0; i < ARRAY_LEN(Languages); ++i) {
+		if (strcmp(name, Languages[i].name)) continue;
+		*lang = Languages[i];
+		return true;
+	}
+	return false;
+}
+
+static void checkMatches(const struct Match *matches, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		struct Language lang;
+		if (!findLanguage(&lang, matches[i].lang)) {
+			errx(EX_SOFTWARE, "no such language %s", matches[i].lang);
+		}
+		if (i && strcmp(matches[i - 1].name, matches[i].name) >= 0) {
+			errx(EX_SOFTWARE, "%s is out of order", matches[i].name);
+		}
+	}
+}
+
 static void check(void) {
+	checkMatches(Names, ARRAY_LEN(Names));
+	checkMatches(Interpreters, ARRAY_LEN(Interpreters));
 	for (size_t i = 0; i < ARRAY_LEN(Languages); ++i) {
-		regex_t regex = compile(Languages[i].pattern, REG_NOSUB);
-		regfree(&regex);
 		for (size_t j = 0; j < Languages[i].len; ++j) {
 			struct Syntax syn = Languages[i].syntax[j];
-			regex = compile(syn.pattern, 0);
+			regex_t regex = compile(syn.pattern, 0);
 			if (syn.subexp >= SubsLen || syn.subexp > regex.re_nsub) {
 				errx(
 					EX_SOFTWARE, "subexpression %zu out of bounds: %s",
@@ -349,7 +425,9 @@ static void check(void) {
 	X(CSS, "css") \
 	X(Document, "document") \
 	X(Inline, "inline") \
+	X(Lines, "lines") \
 	X(Monospace, "monospace") \
+	X(Stats, "stats") \
 	X(Tab, "tab") \
 	X(Title, "title")
 
@@ -404,19 +482,38 @@ static const enum SGR ANSIStyle[ClassLen][3] = {
 	[DiffNew] = { SGRGreen },
 };
 
+// Track the terminal state to output only the changed parameters.
+static enum SGR ansiColor = SGRDefault;
+static enum SGR ansiAttr;
+
+static void ansiSet(enum SGR color, enum SGR attr) {
+	if (color == ansiColor && attr == ansiAttr) return;
+	const char *sep = "";
+	printf("\x1B[");
+	if (attr != ansiAttr && ansiAttr) {
+		printf("%d", (ansiAttr == SGRBoldOn ? SGRBoldOff : SGRUnderlineOff));
+		sep = ";";
+	}
+	if (attr != ansiAttr && attr) {
+		printf("%s%d", sep, attr);
+		sep = ";";
+	}
+	if (color != ansiColor) printf("%s%d", sep, color);
+	printf("m");
+	ansiColor = color;
+	ansiAttr = attr;
+}
+
 static void
 ansiOutput(const char *opts[], enum Class class, const char *str, size_t len) {
 	(void)opts;
-	if (ANSIStyle[class][1]) {
-		printf(
-			"\x1B[%d;%dm%.*s\x1B[%dm",
-			ANSIStyle[class][0], ANSIStyle[class][1],
-			(int)len, str,
-			ANSIStyle[class][2]
-		);
-	} else {
-		printf("\x1B[%dm%.*s", ANSIStyle[class][0], (int)len, str);
-	}
+	ansiSet(ANSIStyle[class][0], ANSIStyle[class][1]);
+	printf("%.*s", (int)len, str);
+}
+
+static void ansiFooter(const char *opts[]) {
+	(void)opts;
+	ansiSet(SGRDefault, 0);
 }
 
 // }}}
@@ -491,10 +588,15 @@ ircOutput(const char *opts[], enum Class class, const char *str, size_t len) {
 
 // HTML format {{{
 
+static size_t cspn(const char *str, size_t len, const char *reject) {
+	size_t run;
+	for (run = 0; run < len && !strchr(reject, str[run]); ++run);
+	return run;
+}
+
 static void htmlEscape(const char *str, size_t len) {
 	while (len) {
-		size_t run = strcspn(str, "\"&<>");
-		if (run > len) run = len;
+		size_t run = cspn(str, len, "\"&<>");
 		switch (str[0]) {
 			break; case '"': run = 1; printf("&quot;");
 			break; case '&': run = 1; printf("&amp;");
@@ -585,10 +687,19 @@ static void htmlAnchor(const char *opts[], const char *str, size_t len) {
 
 static void
 htmlOutput(const char *opts[], enum Class class, const char *str, size_t len) {
+	static size_t line;
+	static bool newline = true;
+	if (opts[Lines] && newline) printf("<a id=\"L%zu\"></a>", ++line);
+	newline = (str[len - 1] == '\n');
+
 	if (opts[Anchor] && class == Tag) {
 		htmlAnchor(opts, str, len);
 		return;
 	}
+	if (class == Normal) {
+		htmlEscape(str, len);
+		return;
+	}
 	if (opts[Inline]) {
 		printf("<span style=\"%s\">", HTMLStyle[class] ? HTMLStyle[class] : "");
 	} else {
@@ -606,8 +717,7 @@ debugOutput(const char *opts[], enum Class class, const char *str, size_t len) {
 	(void)opts;
 	printf("%s\t\"", ClassName[class]);
 	while (len) {
-		size_t run = strcspn(str, "\t\n\"\\");
-		if (run > len) run = len;
+		size_t run = cspn(str, len, "\t\n\"\\");
 		switch (str[0]) {
 			break; case '\t': run = 1; printf("\\t");
 			break; case '\n': run = 1; printf("\\n");
@@ -628,32 +738,67 @@ static const struct Format {
 	HeaderFn *header;
 	HeaderFn *footer;
 } Formats[] = {
-	{ "ansi",  ansiOutput, NULL, NULL },
+	{ "ansi",  ansiOutput, NULL, ansiFooter },
 	{ "irc",   ircOutput, ircHeader, NULL },
 	{ "html",  htmlOutput, htmlHeader, htmlFooter },
 	{ "debug", debugOutput, NULL, NULL },
 };
 
-static bool findLanguage(struct Language *lang, const char *name) {
-	for (size_t i = 0; i < ARRAY_LEN(Languages); ++i) {
-		if (strcmp(name, Languages[i].name)) continue;
-		*lang = Languages[i];
-		return true;
-	}
-	return false;
+static int compareMatch(const void *key, const void *match) {
+	return strcmp(key, ((const struct Match *)match)->name);
+}
+
+static bool lookup(
+	struct Language *lang, const struct Match *matches, size_t len,
+	const char *name
+) {
+	const struct Match *match = bsearch(
+		name, matches, len, sizeof(*matches), compareMatch
+	);
+	return match && findLanguage(lang, match->lang);
 }
 
 static bool matchLanguage(struct Language *lang, const char *name) {
-	for (size_t i = 0; i < ARRAY_LEN(Languages); ++i) {
-		regex_t regex = compile(Languages[i].pattern, REG_NOSUB);
-		int error = regexec(&regex, name, 0, NULL, 0);
-		regfree(&regex);
-		if (error == REG_NOMATCH) continue;
-		if (error) errx(EX_SOFTWARE, "regexec: %d", error);
-		*lang = Languages[i];
-		return true;
+	if (lookup(lang, Names, ARRAY_LEN(Names), name)) return true;
+	const char *ext = strrchr(name, '.');
+	return ext && lookup(lang, Names, ARRAY_LEN(Names), ext);
+}
+
+// Infer the language from a #! line or a vim modeline on the first line.
+static bool sniffLanguage(struct Language *lang, const char *str, size_t len) {
+	char line[256];
+	const char *eol = memchr(str, '\n', len);
+	if (eol) len = eol - str;
+	if (len > sizeof(line) - 1) len = sizeof(line) - 1;
+	memcpy(line, str, len);
+	line[len] = '\0';
+
+	if (!strncmp(line, "#!", 2)) {
+		char *ptr = &line[2];
+		ptr += strspn(ptr, " \t");
+		char *interp = strsep(&ptr, " \t");
+		char *base = strrchr(interp, '/');
+		base = (base ? &base[1] : interp);
+		if (!strcmp(base, "env") && ptr) {
+			ptr += strspn(ptr, " \t");
+			if (ptr[0] == '-') strsep(&ptr, " \t");
+			if (ptr) base = strsep(&ptr, " \t");
+		}
+		return lookup(lang, Interpreters, ARRAY_LEN(Interpreters), base);
 	}
-	return false;
+
+	char *mode = strstr(line, "vim:");
+	if (!mode) return false;
+	char *type;
+	if (NULL != (type = strstr(mode, "filetype="))) {
+		type += 9;
+	} else if (NULL != (type = strstr(mode, "ft="))) {
+		type += 3;
+	} else {
+		return false;
+	}
+	type[strspn(type, "abcdefghijklmnopqrstuvwxyz")] = '\0';
+	return findLanguage(lang, type);
 }
 
 static bool findFormat(struct Format *format, const char *name) {
@@ -665,6 +810,284 @@ static bool findFormat(struct Format *format, const char *name) {
 	return false;
 }
 
+static void render(
+	struct Language lang, struct Format format, const char *opts[],
+	const char *str, size_t len
+) {
+	enum Class *hi = calloc(len, sizeof(*hi));
+	if (!hi) err(EX_OSERR, "calloc");
+
+	highlight(lang, hi, str, len);
+
+	size_t run = 0;
+	if (format.header) format.header(opts);
+	for (size_t i = 0; i < len; i += run) {
+		for (run = 1; i + run < len; ++run) {
+			if (hi[i + run] != hi[i]) break;
+			if (str[i + run - 1] == '\n') break;
+		}
+		format.output(opts, hi[i], &str[i], run);
+	}
+	if (format.footer) format.footer(opts);
+	free(hi);
+}
+
+// Cache {{{
+
+static const char *cacheDir;
+static off_t cacheMax = 64 * 1024 * 1024;
+
+// Entries are named by an FNV-1a hash of the input and its settings, and
+// begin with a second, differently mixed hash of the same and the length
+// of the input, which are checked on read in case of collision.
+struct Key {
+	uint64_t name;
+	uint64_t check;
+	uint64_t len;
+};
+
+static void hash(struct Key *key, const void *ptr, size_t len) {
+	const unsigned char *byte = ptr;
+	for (size_t i = 0; i < len; ++i) {
+		key->name ^= byte[i];
+		key->name *= UINT64_C(0x100000001B3);
+		key->check = (key->check << 5 | key->check >> 59) ^ byte[i];
+		key->check *= UINT64_C(0x9E3779B97F4A7C15);
+	}
+}
+
+static void hashString(struct Key *key, const char *str) {
+	hash(key, (str ? str : ""), (str ? strlen(str) + 1 : 1));
+}
+
+// Bump when output changes other than by the syntax tables, which are
+// part of the key themselves.
+static const char CacheVersion[] = "hi 1";
+
+static void hashSyntax(struct Key *key, const struct Syntax *syntax) {
+	uint64_t fields[] = {
+		syntax->class, syntax->parent, syntax->newline, syntax->subexp,
+	};
+	hash(key, fields, sizeof(fields));
+	hashString(key, syntax->pattern);
+}
+
+static struct Key cacheKey(
+	struct Language lang, struct Format format, const char *opts[],
+	const char *str, size_t len
+) {
+	struct Key key = {
+		.name = UINT64_C(0xCBF29CE484222325),
+		.check = UINT64_C(0x6A09E667F3BCC908),
+		.len = len,
+	};
+	hashString(&key, CacheVersion);
+	hashString(&key, lang.name);
+	for (size_t i = 0; i < lang.len; ++i) {
+		hashSyntax(&key, &lang.syntax[i]);
+	}
+	hashString(&key, format.name);
+	for (enum Option option = 0; option < OptionLen; ++option) {
+		if (option == Stats) continue;
+		hashString(&key, (opts[option] ? OptionKey[option] : NULL));
+		hashString(&key, opts[option]);
+	}
+	hash(&key, str, len);
+	return key;
+}
+
+static void cacheCopy(int fd) {
+	char buf[4096];
+	ssize_t rlen;
+	while (0 < (rlen = read(fd, buf, sizeof(buf)))) {
+		for (ssize_t wlen, off = 0; off < rlen; off += wlen) {
+			wlen = write(STDOUT_FILENO, &buf[off], rlen - off);
+			if (wlen < 0) err(EX_IOERR, "write");
+		}
+	}
+	if (rlen < 0) err(EX_IOERR, "read");
+}
+
+struct Entry {
+	char name[17];
+	time_t mtime;
+	off_t size;
+};
+
+static int compareEntry(const void *_a, const void *_b) {
+	const struct Entry *a = _a, *b = _b;
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+// Temporary files older than this were left by writes which failed.
+enum { TempAge = 60 * 60 };
+
+// Entries are touched on every hit, so the oldest mtime is least recently
+// used.
+static void cacheEvict(void) {
+	DIR *dir = opendir(cacheDir);
+	if (!dir) {
+		warn("%s", cacheDir);
+		return;
+	}
+
+	off_t total = 0;
+	size_t len = 0, cap = 64;
+	struct Entry *entries = malloc(sizeof(*entries) * cap);
+	if (!entries) err(EX_OSERR, "malloc");
+
+	time_t old = time(NULL) - TempAge;
+	struct dirent *ent;
+	while (NULL != (ent = readdir(dir))) {
+		struct stat stat;
+		if (ent->d_name[0] == '.' && strlen(ent->d_name) == 9) {
+			if (fstatat(dirfd(dir), ent->d_name, &stat, 0)) continue;
+			if (stat.st_mtime < old) unlinkat(dirfd(dir), ent->d_name, 0);
+			continue;
+		}
+		if (strlen(ent->d_name) != 16) continue;
+		if (ent->d_name[strspn(ent->d_name, "0123456789abcdef")]) continue;
+		if (fstatat(dirfd(dir), ent->d_name, &stat, 0)) continue;
+		if (len == cap) {
+			entries = realloc(entries, sizeof(*entries) * (cap *= 2));
+			if (!entries) err(EX_OSERR, "realloc");
+		}
+		strcpy(entries[len].name, ent->d_name);
+		entries[len].mtime = stat.st_mtime;
+		entries[len].size = stat.st_size;
+		total += stat.st_size;
+		len++;
+	}
+
+	qsort(entries, len, sizeof(*entries), compareEntry);
+	for (size_t i = 0; i < len && total > cacheMax; ++i) {
+		int error = unlinkat(dirfd(dir), entries[i].name, 0);
+		if (error && errno != ENOENT) warn("%s", entries[i].name);
+		total -= entries[i].size;
+	}
+
+	free(entries);
+	closedir(dir);
+}
+
+static void cacheStats(bool hit, bool show) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stats", cacheDir);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		warn("%s", path);
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	FILE *file = fdopen(fd, "r+");
+	if (!file) err(EX_IOERR, "fdopen");
+	uintmax_t hits = 0, misses = 0;
+	fscanf(file, "%ju %ju", &hits, &misses);
+	if (hit) hits++; else misses++;
+
+	rewind(file);
+	fprintf(file, "%ju %ju\n", hits, misses);
+	if (fflush(file)) warn("%s", path);
+	fclose(file);
+
+	if (show) warnx("%ju hits, %ju misses", hits, misses);
+}
+
+// Output a cached entry if it matches the key.
+static bool cacheHit(int fd, struct Key key) {
+	struct Key head;
+	ssize_t len = read(fd, &head, sizeof(head));
+	if (len != sizeof(head)) return false;
+	if (head.check != key.check || head.len != key.len) return false;
+	// Only the owner of an entry can touch it through a read-only file;
+	// entries shared from other users age by when they were written.
+	int error = futimens(fd, NULL);
+	if (error && errno != EPERM && errno != EACCES) warn("futimens");
+	cacheCopy(fd);
+	return true;
+}
+
+// Render into a temporary file and rename it into place, then stream the
+// entry out as if it were a hit. Returns false, having output nothing, if
+// the entry cannot be written.
+static bool cacheMiss(
+	const char *path, struct Key key,
+	struct Language lang, struct Format format, const char *opts[],
+	const char *str, size_t len
+) {
+	char temp[PATH_MAX];
+	snprintf(temp, sizeof(temp), "%s/.XXXXXXXX", cacheDir);
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		warn("%s", cacheDir);
+		return false;
+	}
+	if (
+		fchmod(fd, 0644) ||
+		write(fd, &key, sizeof(key)) != sizeof(key)
+	) {
+		warn("%s", temp);
+		goto fail;
+	}
+
+	int out = dup(STDOUT_FILENO);
+	if (out < 0) err(EX_OSERR, "dup");
+	if (fflush(stdout) || dup2(fd, STDOUT_FILENO) < 0) err(EX_OSERR, "dup2");
+	render(lang, format, opts, str, len);
+	int error = fflush(stdout);
+	if (error) warn("%s", temp);
+	if (dup2(out, STDOUT_FILENO) < 0) err(EX_OSERR, "dup2");
+	close(out);
+	if (error) goto fail;
+
+	error = rename(temp, path);
+	if (error) {
+		warn("%s", path);
+		unlink(temp);
+	}
+	if (lseek(fd, sizeof(key), SEEK_SET) < 0) err(EX_IOERR, "lseek");
+	cacheCopy(fd);
+	close(fd);
+	return true;
+
+fail:
+	unlink(temp);
+	close(fd);
+	return false;
+}
+
+// Output from the cache, or return false if it cannot be used.
+static bool cache(
+	struct Language lang, struct Format format, const char *opts[],
+	const char *str, size_t len
+) {
+	struct Key key = cacheKey(lang, format, opts, str, len);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%016" PRIx64, cacheDir, key.name);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 && errno != ENOENT) {
+		warn("%s", path);
+		return false;
+	}
+	if (fd >= 0) {
+		bool hit = cacheHit(fd, key);
+		close(fd);
+		if (hit) {
+			cacheStats(true, opts[Stats]);
+			return true;
+		}
+	}
+
+	if (!cacheMiss(path, key, lang, format, opts, str, len)) return false;
+	cacheStats(false, opts[Stats]);
+	cacheEvict();
+	return true;
+}
+
+// }}}
+
 int main(int argc, char *argv[]) {
 	setlocale(LC_CTYPE, "");
 
@@ -675,8 +1098,17 @@ int main(int argc, char *argv[]) {
 	const char *opts[OptionLen] = {0};
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "cf:l:n:o:t"))) {
+	while (0 < (opt = getopt(argc, argv, "C:M:cf:l:n:o:t"))) {
 		switch (opt) {
+			break; case 'C': cacheDir = optarg;
+			break; case 'M': {
+				char *end;
+				long long max = strtoll(optarg, &end, 0);
+				if (!*optarg || *end || max < 0 || max > INT32_MAX) {
+					errx(EX_USAGE, "invalid cache size %s", optarg);
+				}
+				cacheMax = (off_t)max * 1024 * 1024;
+			}
 			break; case 'c': check(); return EX_OK;
 			break; case 'f': {
 				if (!findFormat(&format, optarg)) {
@@ -717,44 +1149,41 @@ int main(int argc, char *argv[]) {
 		name = strrchr(path, '/');
 		name = (name ? &name[1] : path);
 	}
-	if (!lang.name && !matchLanguage(&lang, name) && !text) {
-		errx(EX_USAGE, "cannot infer language for %s", name);
-	}
+	if (!lang.name) matchLanguage(&lang, name);
 	if (!opts[Title]) opts[Title] = name;
 
 	struct stat stat;
 	int error = fstat(fileno(file), &stat);
 	if (error) err(EX_IOERR, "fstat");
 
-	size_t cap = (stat.st_mode & S_IFREG ? stat.st_size + 1 : 4096);
-	char *str = malloc(cap);
-	if (!str) err(EX_OSERR, "malloc");
+	char *str;
+	size_t len = 0;
+	if (S_ISREG(stat.st_mode) && stat.st_size) {
+		len = stat.st_size;
+		str = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (str == MAP_FAILED) err(EX_IOERR, "mmap");
+	} else {
+		size_t cap = 4096;
+		str = malloc(cap);
+		if (!str) err(EX_OSERR, "malloc");
 
-	size_t len = 0, read;
-	while (0 < (read = fread(&str[len], 1, cap - len - 1, file))) {
-		len += read;
-		if (len + 1 < cap) continue;
-		cap *= 2;
-		str = realloc(str, cap);
-		if (!str) err(EX_OSERR, "realloc");
+		size_t read;
+		while (0 < (read = fread(&str[len], 1, cap - len, file))) {
+			len += read;
+			if (len < cap) continue;
+			cap *= 2;
+			str = realloc(str, cap);
+			if (!str) err(EX_OSERR, "realloc");
+		}
+		if (ferror(file)) err(EX_IOERR, "fread");
 	}
-	if (ferror(file)) err(EX_IOERR, "fread");
 	if (memchr(str, 0, len)) errx(EX_DATAERR, "input is binary");
-	str[len] = '\0';
 
-	enum Class *hi = calloc(len, sizeof(*hi));
-	if (!hi) err(EX_OSERR, "calloc");
-
-	highlight(lang, hi, str);
+	if (!lang.name && !sniffLanguage(&lang, str, len) && !text) {
+		errx(EX_USAGE, "cannot infer language for %s", name);
+	}
 
-	size_t run = 0;
-	if (format.header) format.header(opts);
-	for (size_t i = 0; i < len; i += run) {
-		for (run = 1; i + run < len; ++run) {
-			if (hi[i + run] != hi[i]) break;
-			if (str[i + run - 1] == '\n') break;
-		}
-		format.output(opts, hi[i], &str[i], run);
+	if (!cacheDir || !cache(lang, format, opts, str, len)) {
+		render(lang, format, opts, str, len);
 	}
-	if (format.footer) format.footer(opts);
 }
@@ -15,15 +15,20 @@
  */
 
 #include <err.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #if defined __FreeBSD__
 #include <libutil.h>
@@ -35,16 +40,258 @@
 
 typedef unsigned char byte;
 
+static void writeAll(int fd, const byte *ptr, size_t len) {
+	while (len) {
+		ssize_t wlen = write(fd, ptr, len);
+		if (wlen < 0) err(EX_IOERR, "write");
+		ptr += wlen;
+		len -= wlen;
+	}
+}
+
+static void readAll(int fd, void *ptr, size_t len) {
+	while (len) {
+		ssize_t rlen = read(fd, ptr, len);
+		if (rlen < 0) err(EX_IOERR, "read");
+		if (!rlen) errx(EX_IOERR, "unexpected end of recording");
+		ptr = (byte *)ptr + rlen;
+		len -= rlen;
+	}
+}
+
+// Recordings are written by a child process, which compresses blocks of
+// chunks while the parent keeps up with the PTY. The pipe between them
+// bounds how far behind it can fall.
+static int recorder = -1;
+static pid_t recorderPID;
+
+static uint64_t start;
+static uint64_t now(void) {
+	struct timespec time;
+	int error = clock_gettime(CLOCK_MONOTONIC, &time);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000 - start;
+}
+
+struct Record {
+	uint64_t time;
+	uint32_t len;
+};
+
+static void output(const byte *ptr, size_t len) {
+	if (recorder < 0) {
+		writeAll(STDOUT_FILENO, ptr, len);
+		return;
+	}
+	struct Record record = { .time = now(), .len = len };
+	writeAll(recorder, (byte *)&record, sizeof(record));
+	writeAll(recorder, ptr, len);
+}
+
+static struct {
+	byte *ptr;
+	size_t len, cap;
+} block;
+
+static void blockPut(const void *ptr, size_t len) {
+	if (block.len + len > block.cap) {
+		if (!block.cap) block.cap = 4096;
+		while (block.len + len > block.cap) block.cap *= 2;
+		block.ptr = realloc(block.ptr, block.cap);
+		if (!block.ptr) err(EX_OSERR, "realloc");
+	}
+	memcpy(&block.ptr[block.len], ptr, len);
+	block.len += len;
+}
+
+static void put16(byte *ptr, uint16_t n) {
+	ptr[0] = n >> 8;
+	ptr[1] = n;
+}
+static void put32(byte *ptr, uint32_t n) {
+	put16(&ptr[0], n >> 16);
+	put16(&ptr[2], n);
+}
+static void put64(byte *ptr, uint64_t n) {
+	put32(&ptr[0], n >> 32);
+	put32(&ptr[4], n);
+}
+
+enum { BlockSize = 64 * 1024, BlockIdle = 1000 };
+
+static uint64_t offset;
+static struct Entry {
+	uint64_t offset;
+	uint64_t time;
+} *entries;
+static size_t entriesLen;
+
+static void recordWrite(const byte *ptr, size_t len) {
+	writeAll(STDOUT_FILENO, ptr, len);
+	offset += len;
+}
+
+static void blockFlush(uint64_t time) {
+	if (!block.len) return;
+	entries = realloc(entries, sizeof(*entries) * (entriesLen + 1));
+	if (!entries) err(EX_OSERR, "realloc");
+	entries[entriesLen++] = (struct Entry) { offset, time };
+
+	uLong len = compressBound(block.len);
+	byte *data = malloc(8 + len);
+	if (!data) err(EX_OSERR, "malloc");
+	int error = compress2(&data[8], &len, block.ptr, block.len, Z_BEST_SPEED);
+	if (error != Z_OK) errx(EX_SOFTWARE, "compress2: %d", error);
+	put32(&data[0], len);
+	put32(&data[4], block.len);
+	recordWrite(data, 8 + len);
+	free(data);
+	block.len = 0;
+}
+
+static void recordIndex(void) {
+	uint64_t index = offset;
+	byte head[8];
+	put32(&head[0], 0);
+	put32(&head[4], entriesLen);
+	recordWrite(head, sizeof(head));
+	for (size_t i = 0; i < entriesLen; ++i) {
+		byte entry[16];
+		put64(&entry[0], entries[i].offset);
+		put64(&entry[8], entries[i].time);
+		recordWrite(entry, sizeof(entry));
+	}
+	byte tail[8];
+	put64(tail, index);
+	recordWrite(tail, sizeof(tail));
+}
+
+static void record(int fd, struct winsize window) {
+	byte header[12] = "ptee";
+	put32(&header[4], 1);
+	put16(&header[8], window.ws_row);
+	put16(&header[10], window.ws_col);
+	recordWrite(header, sizeof(header));
+
+	byte *data = NULL;
+	size_t cap = 0;
+	uint64_t time = 0;
+	struct pollfd pfd = { .events = POLLIN, .fd = fd };
+	for (;;) {
+		int nfds = poll(&pfd, 1, (block.len ? BlockIdle : -1));
+		if (nfds < 0) err(EX_IOERR, "poll");
+		if (!nfds) {
+			blockFlush(time);
+			continue;
+		}
+
+		struct Record record;
+		ssize_t rlen = read(fd, &record, sizeof(record));
+		if (rlen < 0) err(EX_IOERR, "read");
+		if (!rlen) break;
+		readAll(fd, (byte *)&record + rlen, sizeof(record) - rlen);
+		if (record.len > cap) {
+			cap = record.len;
+			data = realloc(data, cap);
+			if (!data) err(EX_OSERR, "realloc");
+		}
+		readAll(fd, data, record.len);
+
+		if (!block.len) time = record.time;
+		byte chunk[12];
+		put64(&chunk[0], record.time);
+		put32(&chunk[8], record.len);
+		blockPut(chunk, sizeof(chunk));
+		blockPut(data, record.len);
+		if (block.len >= BlockSize) blockFlush(time);
+	}
+	blockFlush(time);
+	recordIndex();
+}
+
+static void recordStart(struct winsize window) {
+	int rw[2];
+	int error = pipe(rw);
+	if (error) err(EX_OSERR, "pipe");
+
+	recorderPID = fork();
+	if (recorderPID < 0) err(EX_OSERR, "fork");
+	if (!recorderPID) {
+		close(rw[1]);
+		record(rw[0], window);
+		_exit(EX_OK);
+	}
+
+	close(rw[0]);
+	fcntl(rw[1], F_SETFD, FD_CLOEXEC);
+	recorder = rw[1];
+	start = now();
+}
+
+static void recordFinish(void) {
+	if (recorder < 0) return;
+	close(recorder);
+	int status;
+	pid_t dead = waitpid(recorderPID, &status, 0);
+	if (dead < 0) warn("waitpid");
+	if (dead > 0 && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+		warnx("recording failed");
+	}
+}
+
+static bool stop;
+
+// Grow the buffer while the PTY keeps filling it.
+enum { BufMin = 4096, BufMax = 1024 * 1024 };
+static size_t cap = BufMin;
+static byte *buf;
+
+static ssize_t copyOut(int pty) {
+	ssize_t rlen = read(pty, buf, cap);
+	if (rlen <= 0) return rlen;
+
+	writeAll(STDIN_FILENO, buf, rlen);
+	if (!stop) output(buf, rlen);
+
+	if ((size_t)rlen == cap && cap < BufMax) {
+		cap *= 2;
+		buf = realloc(buf, cap);
+		if (!buf) err(EX_OSERR, "realloc");
+	}
+	return rlen;
+}
+
 static struct termios saveTerm;
 static void restoreTerm(void) {
 	tcsetattr(STDIN_FILENO, TCSADRAIN, &saveTerm);
 }
 
 int main(int argc, char *argv[]) {
-	if (argc < 2) return EX_USAGE;
+	bool rec = false;
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "+r"))) {
+		switch (opt) {
+			break; case 'r': rec = true;
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (optind == argc) return EX_USAGE;
+	argv += optind - 1;
 	if (isatty(STDOUT_FILENO)) errx(EX_USAGE, "stdout is not redirected");
 
-	int error = tcgetattr(STDIN_FILENO, &saveTerm);
+	struct winsize window;
+	int error = ioctl(STDIN_FILENO, TIOCGWINSZ, &window);
+	if (error) err(EX_IOERR, "ioctl");
+
+	// The recorder is started before the terminal is made raw, so that it
+	// does not inherit the handler which restores it.
+	if (rec) {
+		recordStart(window);
+		atexit(recordFinish);
+	}
+
+	error = tcgetattr(STDIN_FILENO, &saveTerm);
 	if (error) err(EX_IOERR, "tcgetattr");
 	atexit(restoreTerm);
 
@@ -53,29 +300,26 @@ int main(int argc, char *argv[]) {
 	error = tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
 	if (error) err(EX_IOERR, "tcsetattr");
 
-	struct winsize window;
-	error = ioctl(STDIN_FILENO, TIOCGWINSZ, &window);
-	if (error) err(EX_IOERR, "ioctl");
-
 	int pty;
 	pid_t pid = forkpty(&pty, NULL, NULL, &window);
 	if (pid < 0) err(EX_OSERR, "forkpty");
 
 	if (!pid) {
+		recorder = -1;
 		execvp(argv[1], &argv[1]);
 		err(EX_NOINPUT, "%s", argv[1]);
 	}
 
-	bool stop = false;
+	buf = malloc(cap);
+	if (!buf) err(EX_OSERR, "malloc");
 
-	byte buf[4096];
 	struct pollfd fds[2] = {
 		{ .events = POLLIN, .fd = STDIN_FILENO },
 		{ .events = POLLIN, .fd = pty },
 	};
 	while (0 < poll(fds, 2, -1)) {
 		if (fds[0].revents & POLLIN) {
-			ssize_t rlen = read(STDIN_FILENO, buf, sizeof(buf));
+			ssize_t rlen = read(STDIN_FILENO, buf, BufMin);
 			if (rlen < 0) err(EX_IOERR, "read");
 
 			if (rlen == 1 && buf[0] == CTRL('S')) {
@@ -84,33 +328,27 @@ int main(int argc, char *argv[]) {
 			}
 
 			if (rlen == 1 && buf[0] == CTRL('Q')) {
-				char dump[] = "\x1B[10i";
-				ssize_t wlen = write(STDOUT_FILENO, dump, sizeof(dump) - 1);
-				if (wlen < 0) err(EX_IOERR, "write");
+				byte dump[] = "\x1B[10i";
+				output(dump, sizeof(dump) - 1);
 				continue;
 			}
 
-			ssize_t wlen = write(pty, buf, rlen);
-			if (wlen < 0) err(EX_IOERR, "write");
+			writeAll(pty, buf, rlen);
 		}
 
 		if (fds[1].revents & POLLIN) {
-			ssize_t rlen = read(pty, buf, sizeof(buf));
+			ssize_t rlen = copyOut(pty);
 			if (rlen < 0) err(EX_IOERR, "read");
-
-			ssize_t wlen = write(STDIN_FILENO, buf, rlen);
-			if (wlen < 0) err(EX_IOERR, "write");
-
-			if (!stop) {
-				wlen = write(STDOUT_FILENO, buf, rlen);
-				if (wlen < 0) err(EX_IOERR, "write");
-			}
 		}
 
 		int status;
 		pid_t dead = waitpid(pid, &status, WNOHANG);
 		if (dead < 0) err(EX_OSERR, "waitpid");
-		if (dead) return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+		if (dead) {
+			// Drain output the child wrote before exiting.
+			while (0 < poll(&fds[1], 1, 0) && 0 < copyOut(pty));
+			return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+		}
 	}
 	err(EX_IOERR, "poll");
 }
@@ -15,16 +15,20 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sysexits.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -32,51 +36,364 @@
 #include <sys/capsicum.h>
 #endif
 
-static void clientWrite(struct tls *client, const char *ptr, size_t len) {
-	while (len) {
-		ssize_t ret = tls_write(client, ptr, len);
-		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) continue;
-		if (ret < 0) errx(EX_IOERR, "tls_write: %s", tls_error(client));
-		ptr += ret;
-		len -= ret;
+#ifdef WITH_CASPER
+#include <libcasper.h>
+#include <casper/cap_net.h>
+#endif
+
+struct Buffer {
+	char *ptr;
+	size_t len, cap;
+};
+
+static void bufferReserve(struct Buffer *buf, size_t len) {
+	if (buf->len + len <= buf->cap) return;
+	if (!buf->cap) buf->cap = 4096;
+	while (buf->len + len > buf->cap) buf->cap *= 2;
+	buf->ptr = realloc(buf->ptr, buf->cap);
+	if (!buf->ptr) err(EX_OSERR, "realloc");
+}
+
+static void bufferPut(struct Buffer *buf, const char *ptr, size_t len) {
+	bufferReserve(buf, len);
+	memcpy(&buf->ptr[buf->len], ptr, len);
+	buf->len += len;
+}
+
+static void bufferShift(struct Buffer *buf, size_t len) {
+	buf->len -= len;
+	memmove(buf->ptr, &buf->ptr[len], buf->len);
+}
+
+// Return the next complete line, resuming the search for its end where the
+// last call left off. Once only a partial line remains, it is moved to the
+// front of the buffer and NULL is returned.
+static char *bufferLine(struct Buffer *buf, size_t *line, size_t *scan) {
+	char *lf = memchr(&buf->ptr[*scan], '\n', buf->len - *scan);
+	if (!lf) {
+		bufferShift(buf, *line);
+		*scan = buf->len;
+		*line = 0;
+		return NULL;
+	}
+	char *ptr = &buf->ptr[*line];
+	*lf = '\0';
+	if (lf > ptr && lf[-1] == '\r') lf[-1] = '\0';
+	*line = *scan = lf - buf->ptr + 1;
+	return ptr;
+}
+
+enum { LineCap = 16 * 1024 };
+
+// Reconnection delays in seconds, doubling after each failure.
+enum { BackoffMin = 1, BackoffMax = 300 };
+
+// At the end of input, networks not yet registered are given this many
+// seconds to do so.
+enum { RegisterWait = 30 };
+
+// Input is sent at rate messages per second after a burst, and dropped
+// once backlog messages are waiting. Coalesced messages are kept short
+// enough to fit in an IRC line once relayed with a prefix.
+static double rate = 0.5;
+static double burst = 5;
+static size_t backlog = 100;
+static bool coalesce;
+enum { CoalesceCap = 400 };
+
+static struct tls_config *config;
+
+static struct Network {
+	const char *host, *port, *nick;
+	const char *chans;
+	enum { Idle, Connecting, Handshaking, Connected } state;
+	struct addrinfo *head, *ai;
+	int sock;
+	struct tls *client;
+	bool registered;
+	unsigned collisions;
+	time_t retry;
+	time_t backoff;
+	// Messages are queued and written as the socket becomes writable. The
+	// events wanted by the last write are kept for the next poll.
+	struct Buffer queue;
+	short want;
+	struct Buffer buf;
+	size_t scan;
+	// Input waiting to be sent, as pairs of channel and message.
+	struct Buffer input;
+	size_t first, last, count;
+	double tokens, refill;
+	size_t dropped;
+	char *dropChan;
+	unsigned long sent, drops;
+	bool quit;
+} *networks;
+static size_t nnetworks;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// With more than one channel, lines are prefixed with host/chan.
+static bool multi;
+static bool quit;
+static double quitTime;
+
+// Check whether chan is in a network's comma-separated list of channels.
+static bool isChan(const struct Network *net, const char *chan) {
+	size_t len = strlen(chan);
+	for (const char *ptr = net->chans; *ptr; ptr += strcspn(ptr, ",")) {
+		if (*ptr == ',') ptr++;
+		if (!strncmp(ptr, chan, len) && (!ptr[len] || ptr[len] == ',')) {
+			return true;
+		}
 	}
+	return false;
 }
 
-static void clientFormat(struct tls *client, const char *format, ...) {
+static void netClose(struct Network *net) {
+	if (net->client) {
+		tls_close(net->client);
+		tls_free(net->client);
+		net->client = NULL;
+	}
+	if (net->sock >= 0) close(net->sock);
+	net->sock = -1;
+	if (net->head) freeaddrinfo(net->head);
+	net->head = net->ai = NULL;
+	net->queue.len = 0;
+	net->buf.len = net->scan = 0;
+	net->registered = false;
+	net->collisions = 0;
+	net->quit = false;
+	net->state = Idle;
+}
+
+// Close the connection and schedule another attempt, unless quitting.
+static void netRetry(struct Network *net) {
+	netClose(net);
+	if (quit) return;
+	net->retry = time(NULL) + net->backoff;
+	warnx("%s: reconnecting in %llds", net->host, (long long)net->backoff);
+	net->backoff *= 2;
+	if (net->backoff > BackoffMax) net->backoff = BackoffMax;
+}
+
+static void netFormat(struct Network *net, const char *format, ...) {
 	char buf[1024];
 	va_list ap;
 	va_start(ap, format);
 	int len = vsnprintf(buf, sizeof(buf), format, ap);
 	va_end(ap);
-	if ((size_t)len > sizeof(buf) - 1) errx(EX_DATAERR, "message too large");
-	clientWrite(client, buf, len);
+	if ((size_t)len > sizeof(buf) - 1) {
+		warnx("%s: message too large", net->host);
+		return;
+	}
+	bufferPut(&net->queue, buf, len);
 }
 
-static void clientHandle(struct tls *client, const char *chan, char *line) {
+static void netFlush(struct Network *net) {
+	size_t sent = 0;
+	net->want = 0;
+	while (sent < net->queue.len) {
+		ssize_t ret = tls_write(
+			net->client, &net->queue.ptr[sent], net->queue.len - sent
+		);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+			net->want = (ret == TLS_WANT_POLLIN ? POLLIN : POLLOUT);
+			break;
+		}
+		if (ret < 0) {
+			warnx("%s: tls_write: %s", net->host, tls_error(net->client));
+			netRetry(net);
+			return;
+		}
+		sent += ret;
+	}
+	bufferShift(&net->queue, sent);
+}
+
+// In capability mode, names are resolved and sockets connected through
+// Casper, limited to the networks given.
+#ifdef WITH_CASPER
+static cap_channel_t *casper;
+#endif
+
+static int resolve(
+	const char *host, const char *port, const struct addrinfo *hints,
+	struct addrinfo **res
+) {
+#ifdef WITH_CASPER
+	return cap_getaddrinfo(casper, host, port, hints, res);
+#else
+	return getaddrinfo(host, port, hints, res);
+#endif
+}
+
+static int connectTo(int sock, const struct addrinfo *ai) {
+#ifdef WITH_CASPER
+	return cap_connect(casper, sock, ai->ai_addr, ai->ai_addrlen);
+#else
+	return connect(sock, ai->ai_addr, ai->ai_addrlen);
+#endif
+}
+
+#ifdef __FreeBSD__
+static void limit(int fd, const cap_rights_t *rights) {
+	int error = cap_rights_limit(fd, rights);
+	if (error) err(EX_OSERR, "cap_rights_limit");
+}
+#endif
+
+// Start connecting to the next address, or to the first after a lookup.
+static void netConnect(struct Network *net) {
+	if (!net->head) {
+		struct addrinfo hints = {
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+			.ai_protocol = IPPROTO_TCP,
+		};
+		int error = resolve(net->host, net->port, &hints, &net->head);
+		if (error) {
+			warnx("%s: getaddrinfo: %s", net->host, gai_strerror(error));
+			net->head = NULL;
+			netRetry(net);
+			return;
+		}
+		net->ai = net->head;
+	}
+
+	for (; net->ai; net->ai = net->ai->ai_next) {
+		struct addrinfo *ai = net->ai;
+		net->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (net->sock < 0) err(EX_OSERR, "socket");
+		fcntl(net->sock, F_SETFD, FD_CLOEXEC);
+		fcntl(net->sock, F_SETFL, O_NONBLOCK);
+#ifdef __FreeBSD__
+		cap_rights_t rights;
+		cap_rights_init(
+			&rights, CAP_CONNECT, CAP_EVENT, CAP_GETSOCKOPT,
+			CAP_READ, CAP_WRITE
+		);
+		limit(net->sock, &rights);
+#endif
+
+		int error = connectTo(net->sock, ai);
+		if (!error || errno == EINPROGRESS) {
+			net->state = Connecting;
+			return;
+		}
+		close(net->sock);
+		net->sock = -1;
+	}
+	warn("%s: connect", net->host);
+	netRetry(net);
+}
+
+static void netHandshake(struct Network *net) {
+	int ret = tls_handshake(net->client);
+	if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+		net->want = (ret == TLS_WANT_POLLIN ? POLLIN : POLLOUT);
+		return;
+	}
+	if (ret < 0) {
+		warnx("%s: tls_handshake: %s", net->host, tls_error(net->client));
+		netRetry(net);
+		return;
+	}
+	net->state = Connected;
+	netFormat(
+		net, "NICK :%s\r\nUSER %s 0 * :%s\r\n",
+		net->nick, net->nick, net->nick
+	);
+}
+
+// Once the socket is writable, check the connection and start TLS on it,
+// or move on to the next address.
+static void netConnected(struct Network *net) {
+	int error;
+	socklen_t len = sizeof(error);
+	int fail = getsockopt(net->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+	if (fail || error) {
+		close(net->sock);
+		net->sock = -1;
+		net->ai = net->ai->ai_next;
+		errno = (fail ? errno : error);
+		if (!net->ai) {
+			warn("%s: connect", net->host);
+			netRetry(net);
+			return;
+		}
+		netConnect(net);
+		return;
+	}
+	freeaddrinfo(net->head);
+	net->head = net->ai = NULL;
+
+	net->client = tls_client();
+	if (!net->client) errx(EX_SOFTWARE, "tls_client");
+	error = tls_configure(net->client, config);
+	if (error) errx(EX_SOFTWARE, "tls_configure: %s", tls_error(net->client));
+
+	error = tls_connect_socket(net->client, net->sock, net->host);
+	if (error) {
+		warnx("%s: tls_connect: %s", net->host, tls_error(net->client));
+		netRetry(net);
+		return;
+	}
+	net->state = Handshaking;
+	netHandshake(net);
+}
+
+static const char *netHandle(struct Network *net, char *line) {
 	char *prefix = NULL;
 	if (line[0] == ':') {
 		prefix = strsep(&line, " ") + 1;
-		if (!line) errx(EX_PROTOCOL, "unexpected eol");
+		if (!line) return "unexpected eol";
 	}
 
 	char *command = strsep(&line, " ");
+	if (!strcmp(command, "001")) {
+		net->registered = true;
+		net->backoff = BackoffMin;
+		net->tokens = burst;
+		net->refill = now();
+	}
 	if (!strcmp(command, "001") || !strcmp(command, "INVITE")) {
-		clientFormat(client, "JOIN :%s\r\n", chan);
+		netFormat(net, "JOIN :%s\r\n", net->chans);
 	} else if (!strcmp(command, "PING")) {
-		clientFormat(client, "PONG %s\r\n", line);
+		netFormat(net, "PONG %s\r\n", line);
+	} else if (!strcmp(command, "ERROR")) {
+		return (line ? line : "error");
+	}
+
+	// Try the nick with up to as many underscores appended while it is in
+	// use during registration.
+	static const char Underscores[] = "____";
+	if (!strcmp(command, "433") && !net->registered) {
+		if (net->collisions == sizeof(Underscores) - 1) return "nick in use";
+		net->collisions++;
+		netFormat(
+			net, "NICK :%s%.*s\r\n",
+			net->nick, (int)net->collisions, Underscores
+		);
 	}
-	if (strcmp(command, "PRIVMSG") && strcmp(command, "NOTICE")) return;
+	if (strcmp(command, "PRIVMSG") && strcmp(command, "NOTICE")) return NULL;
 
-	if (!prefix) errx(EX_PROTOCOL, "message without prefix");
+	if (!prefix) return "message without prefix";
 	char *nick = strsep(&prefix, "!");
 
-	if (!line) errx(EX_PROTOCOL, "message without destination");
+	if (!line) return "message without destination";
 	char *dest = strsep(&line, " ");
-	if (strcmp(dest, chan)) return;
+	if (!isChan(net, dest)) return NULL;
 
-	if (!line || line[0] != ':') errx(EX_PROTOCOL, "message without message");
+	if (!line || line[0] != ':') return "message without message";
 	line = &line[1];
 
+	if (multi) printf("%s/%s ", net->host, dest);
 	if (!strncmp(line, "\1ACTION ", 8)) {
 		line = &line[8];
 		size_t len = strcspn(line, "\1");
@@ -86,72 +403,184 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 	} else {
 		printf("<%c\u200C%s> %s\n", nick[0], &nick[1], line);
 	}
+	return NULL;
 }
 
-#ifdef __FreeBSD__
-static void limit(int fd, const cap_rights_t *rights) {
-	int error = cap_rights_limit(fd, rights);
-	if (error) err(EX_OSERR, "cap_rights_limit");
+// Read everything available from the server.
+static void netRead(struct Network *net) {
+	for (;;) {
+		bufferReserve(&net->buf, 4096);
+		ssize_t ret = tls_read(
+			net->client, &net->buf.ptr[net->buf.len],
+			net->buf.cap - net->buf.len
+		);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) return;
+		if (ret < 0) {
+			warnx("%s: tls_read: %s", net->host, tls_error(net->client));
+			netRetry(net);
+			return;
+		}
+		if (!ret) {
+			if (!quit) warnx("%s: connection closed", net->host);
+			netRetry(net);
+			return;
+		}
+		net->buf.len += ret;
+
+		char *line;
+		size_t start = 0;
+		while (NULL != (line = bufferLine(&net->buf, &start, &net->scan))) {
+			const char *error = netHandle(net, line);
+			if (!error) continue;
+			warnx("%s: %s", net->host, error);
+			netRetry(net);
+			return;
+		}
+		if (net->buf.len > LineCap) {
+			warnx("%s: line too long", net->host);
+			netRetry(net);
+			return;
+		}
+	}
 }
-#endif
-
-int main(int argc, char *argv[]) {
-	int error;
-
-	if (argc < 5) return EX_USAGE;
-	const char *host = argv[1];
-	const char *port = argv[2];
-	const char *nick = argv[3];
-	const char *chan = argv[4];
-
-	setlinebuf(stdout);
-	signal(SIGPIPE, SIG_IGN);
 
-	struct tls_config *config = tls_config_new();
-	if (!config) errx(EX_SOFTWARE, "tls_config_new");
-
-	error = tls_config_set_ciphers(config, "compat");
-	if (error) {
-		errx(EX_SOFTWARE, "tls_config_set_ciphers: %s", tls_config_error(config));
+static void netPush(struct Network *net, const char *chan, const char *msg) {
+	struct Buffer *buf = &net->input;
+	size_t len = strlen(msg);
+	if (coalesce && net->count && !strcmp(&buf->ptr[net->last], chan)) {
+		const char *prev = &buf->ptr[net->last + strlen(chan) + 1];
+		if (strlen(prev) + 3 + len <= CoalesceCap) {
+			buf->len--;
+			bufferPut(buf, " | ", 3);
+			bufferPut(buf, msg, len + 1);
+			return;
+		}
 	}
+	net->last = buf->len;
+	bufferPut(buf, chan, strlen(chan) + 1);
+	bufferPut(buf, msg, len + 1);
+	net->count++;
+}
 
-	struct tls *client = tls_client();
-	if (!client) errx(EX_SOFTWARE, "tls_client");
+// Input is queued while the network is not registered, and sent once it is.
+static void netInput(struct Network *net, const char *chan, const char *msg) {
+	if (net->count < backlog) {
+		netPush(net, chan, msg);
+		return;
+	}
+	net->dropped++;
+	net->drops++;
+	if (net->dropChan && !strcmp(net->dropChan, chan)) return;
+	free(net->dropChan);
+	net->dropChan = strdup(chan);
+	if (!net->dropChan) err(EX_OSERR, "strdup");
+}
 
-	error = tls_configure(client, config);
-	if (error) errx(EX_SOFTWARE, "tls_configure: %s", tls_error(client));
-	tls_config_free(config);
+// Send waiting input as tokens allow, and once there is room, a summary
+// of any input dropped.
+static void netSend(struct Network *net, double time) {
+	net->tokens += (time - net->refill) * rate;
+	if (net->tokens > burst) net->tokens = burst;
+	net->refill = time;
+
+	if (net->dropped && net->count < backlog) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "(%zu lines dropped)", net->dropped);
+		netPush(net, net->dropChan, msg);
+		net->dropped = 0;
+	}
 
-	struct addrinfo *head;
-	struct addrinfo hints = {
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-		.ai_protocol = IPPROTO_TCP,
-	};
-	error = getaddrinfo(host, port, &hints, &head);
-	if (error) errx(EX_NOHOST, "getaddrinfo: %s", gai_strerror(error));
+	struct Buffer *buf = &net->input;
+	while (net->count && net->tokens >= 1) {
+		const char *chan = &buf->ptr[net->first];
+		const char *msg = &chan[strlen(chan) + 1];
+		netFormat(net, "NOTICE %s :%s\r\n", chan, msg);
+		net->first = &msg[strlen(msg) + 1] - buf->ptr;
+		net->count--;
+		net->sent++;
+		net->tokens--;
+	}
+	if (!net->count) {
+		buf->len = net->first = net->last = 0;
+	} else if (net->first > buf->len / 2) {
+		bufferShift(buf, net->first);
+		net->last -= net->first;
+		net->first = 0;
+	}
+}
 
-	int sock = -1;
-	for (struct addrinfo *ai = head; ai; ai = ai->ai_next) {
-		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sock < 0) err(EX_OSERR, "socket");
+// Send a line of input to the channel, or with more than one channel, to
+// each channel named by its host/chan or chan prefix. A host which is not
+// one of ours matches any network, so output can be piped to another relay.
+static void input(char *line) {
+	if (!multi) {
+		struct Network *net = &networks[0];
+		netInput(net, net->chans, line);
+		return;
+	}
 
-		error = connect(sock, ai->ai_addr, ai->ai_addrlen);
-		if (!error) break;
+	char *chan = strsep(&line, " ");
+	if (!line) return;
+	char *host = NULL;
+	if (strchr(chan, '/')) {
+		host = chan;
+		*strrchr(chan, '/') = '\0';
+		chan += strlen(host) + 1;
+	}
+	bool any = true;
+	for (size_t i = 0; host && i < nnetworks; ++i) {
+		if (!strcmp(networks[i].host, host)) any = false;
+	}
+	for (size_t i = 0; i < nnetworks; ++i) {
+		struct Network *net = &networks[i];
+		if (!any && strcmp(net->host, host)) continue;
+		if (isChan(net, chan)) netInput(net, chan, line);
+	}
+}
 
-		close(sock);
-		sock = -1;
+// Queue a message for each line of input available, to be written to the
+// servers together.
+static bool inputRead(void) {
+	static struct Buffer buf;
+	static size_t scan;
+	bufferReserve(&buf, 4096);
+	ssize_t len = read(STDIN_FILENO, &buf.ptr[buf.len], buf.cap - buf.len);
+	if (len < 0) err(EX_IOERR, "read");
+	if (!len) return false;
+	buf.len += len;
+
+	char *line;
+	size_t start = 0;
+	while (NULL != (line = bufferLine(&buf, &start, &scan))) {
+		input(line);
 	}
-	if (sock < 0) err(EX_UNAVAILABLE, "connect");
-	freeaddrinfo(head);
+	if (buf.len > LineCap) errx(EX_DATAERR, "line too long");
+	return true;
+}
 
-	error = tls_connect_socket(client, sock, host);
-	if (error) errx(EX_PROTOCOL, "tls_connect: %s", tls_error(client));
+static void sandbox(void) {
+#ifdef WITH_CASPER
+	cap_channel_t *cas = cap_init();
+	if (!cas) err(EX_OSERR, "cap_init");
+	casper = cap_service_open(cas, "system.net");
+	if (!casper) err(EX_OSERR, "cap_service_open");
+	cap_close(cas);
+
+	cap_net_limit_t *names = cap_net_limit_init(
+		casper, CAPNET_NAME2ADDR | CAPNET_CONNECTDNS
+	);
+	if (!names) err(EX_OSERR, "cap_net_limit_init");
+	for (size_t i = 0; i < nnetworks; ++i) {
+		cap_net_limit_name2addr(names, networks[i].host, networks[i].port);
+	}
+	int error = cap_net_limit(names);
+	if (error) err(EX_OSERR, "cap_net_limit");
 
-#ifdef __FreeBSD__
 	error = cap_enter();
 	if (error) err(EX_OSERR, "cap_enter");
+#endif
 
+#ifdef __FreeBSD__
 	cap_rights_t rights;
 	cap_rights_init(&rights, CAP_WRITE);
 	limit(STDOUT_FILENO, &rights);
@@ -159,49 +588,157 @@ int main(int argc, char *argv[]) {
 
 	cap_rights_init(&rights, CAP_EVENT, CAP_READ);
 	limit(STDIN_FILENO, &rights);
-
-	cap_rights_set(&rights, CAP_WRITE);
-	limit(sock, &rights);
 #endif
+}
+
+static volatile sig_atomic_t stats;
+static void statsHandler(int sig) {
+	(void)sig;
+	stats = 1;
+}
+
+int main(int argc, char *argv[]) {
+	int error;
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "b:cq:r:"))) {
+		switch (opt) {
+			break; case 'b': burst = strtod(optarg, NULL);
+			break; case 'c': coalesce = true;
+			break; case 'q': backlog = strtoul(optarg, NULL, 10);
+			break; case 'r': rate = strtod(optarg, NULL);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (burst < 1 || rate <= 0) errx(EX_USAGE, "invalid rate");
+	argc -= optind;
+	argv += optind;
+	if (argc < 4 || argc % 4) return EX_USAGE;
+
+	setlinebuf(stdout);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, statsHandler);
+
+	config = tls_config_new();
+	if (!config) errx(EX_SOFTWARE, "tls_config_new");
 
-	clientFormat(client, "NICK :%s\r\nUSER %s 0 * :%s\r\n", nick, nick, nick);
-
-	char *input = NULL;
-	size_t cap = 0;
-
-	char buf[4096];
-	size_t len = 0;
-
-	struct pollfd fds[2] = {
-		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = sock },
-	};
-	while (0 < poll(fds, 2, -1)) {
-		if (fds[0].revents) {
-			ssize_t len = getline(&input, &cap, stdin);
-			if (len < 0) err(EX_IOERR, "getline");
-			input[len - 1] = '\0';
-			clientFormat(client, "NOTICE %s :%s\r\n", chan, input);
-		}
-		if (!fds[1].revents) continue;
-
-		ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
-		if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) continue;
-		if (read < 0) errx(EX_IOERR, "tls_read: %s", tls_error(client));
-		if (!read) return EX_UNAVAILABLE;
-		len += read;
-
-		char *crlf;
-		char *line = buf;
-		for (;;) {
-			crlf = memmem(line, &buf[len] - line, "\r\n", 2);
-			if (!crlf) break;
-			crlf[0] = '\0';
-			clientHandle(client, chan, line);
-			line = &crlf[2];
-		}
-		len -= line - buf;
-		memmove(buf, line, len);
-	}
-	err(EX_IOERR, "poll");
+	error = tls_config_set_ciphers(config, "compat");
+	if (error) {
+		errx(EX_SOFTWARE, "tls_config_set_ciphers: %s", tls_config_error(config));
+	}
+
+	nnetworks = argc / 4;
+	networks = calloc(nnetworks, sizeof(*networks));
+	if (!networks) err(EX_OSERR, "calloc");
+	for (size_t i = 0; i < nnetworks; ++i) {
+		struct Network *net = &networks[i];
+		net->host = argv[4 * i + 0];
+		net->port = argv[4 * i + 1];
+		net->nick = argv[4 * i + 2];
+		net->chans = argv[4 * i + 3];
+		net->sock = -1;
+		net->backoff = BackoffMin;
+		if (strchr(net->chans, ',')) multi = true;
+	}
+	if (nnetworks > 1) multi = true;
+
+	sandbox();
+	for (size_t i = 0; i < nnetworks; ++i) {
+		netConnect(&networks[i]);
+	}
+
+	struct pollfd *fds = calloc(1 + nnetworks, sizeof(*fds));
+	if (!fds) err(EX_OSERR, "calloc");
+	fds[0] = (struct pollfd) { .events = POLLIN, .fd = STDIN_FILENO };
+	for (;;) {
+		time_t wall = time(NULL);
+		double mono = now();
+		int timeout = -1;
+		bool active = false;
+		for (size_t i = 0; i < nnetworks; ++i) {
+			struct Network *net = &networks[i];
+			struct pollfd *fd = &fds[1 + i];
+			*fd = (struct pollfd) { .fd = net->sock };
+			if (net->state == Connecting) {
+				fd->events = POLLOUT;
+			} else if (net->state == Handshaking) {
+				fd->events = net->want;
+			} else if (net->state == Connected) {
+				fd->events = POLLIN | (net->queue.len ? net->want : 0);
+				if (net->registered && net->count && net->tokens < 1) {
+					int ms = 1 + (1 - net->tokens) / rate * 1000;
+					if (timeout < 0 || ms < timeout) timeout = ms;
+				}
+			} else if (!quit) {
+				int ms = (net->retry > wall ? net->retry - wall : 0) * 1000;
+				if (timeout < 0 || ms < timeout) timeout = ms;
+			}
+			if (net->state != Idle) active = true;
+			if (quit && net->state != Idle && !net->registered) {
+				double wait = quitTime + RegisterWait - mono;
+				int ms = 1 + (wait > 0 ? wait : 0) * 1000;
+				if (timeout < 0 || ms < timeout) timeout = ms;
+			}
+		}
+		if (quit && !active) return EX_OK;
+
+		int nfds = poll(fds, 1 + nnetworks, timeout);
+		if (nfds < 0 && errno != EINTR) err(EX_IOERR, "poll");
+
+		if (stats) {
+			for (size_t i = 0; i < nnetworks; ++i) {
+				struct Network *net = &networks[i];
+				warnx(
+					"%s: %zu queued, %lu sent, %lu dropped",
+					net->host, net->count, net->sent, net->drops
+				);
+			}
+			stats = 0;
+		}
+		if (nfds < 0) continue;
+
+		// At the end of input, quit once waiting input has been sent,
+		// waiting for networks still connecting to register.
+		if (fds[0].revents && !inputRead()) {
+			fds[0].fd = -1;
+			quit = true;
+			quitTime = now();
+		}
+
+		wall = time(NULL);
+		for (size_t i = 0; i < nnetworks; ++i) {
+			struct Network *net = &networks[i];
+			if (net->state == Idle) {
+				if (!quit && net->retry <= wall) netConnect(net);
+				continue;
+			}
+			if (!fds[1 + i].revents) continue;
+			if (net->state == Connecting) {
+				netConnected(net);
+			} else if (net->state == Handshaking) {
+				netHandshake(net);
+			} else {
+				netRead(net);
+			}
+		}
+
+		mono = now();
+		for (size_t i = 0; i < nnetworks; ++i) {
+			struct Network *net = &networks[i];
+			if (
+				quit && net->state != Idle && !net->registered &&
+				mono >= quitTime + RegisterWait
+			) {
+				warnx("%s: not registered, giving up", net->host);
+				netClose(net);
+			}
+			if (net->state != Connected) continue;
+			if (net->registered) netSend(net, mono);
+			if (quit && net->registered && !net->quit && !net->count) {
+				netFormat(net, "QUIT\r\n");
+				net->quit = true;
+			}
+			netFlush(net);
+		}
+	}
 }
@@ -16,15 +16,26 @@
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <locale.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sysexits.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <zlib.h>
 
 #define BIT(x) x##Bit, x = 1 << x##Bit, x##Bit_ = x##Bit
 
@@ -47,28 +58,87 @@ enum Attr {
 	BIT(Reverse),
 };
 
+// Colors are -1 for the default, 0 to 255 for the palette, or TrueColor
+// with 24-bit RGB.
+enum { TrueColor = 1 << 24 };
+
 struct Style {
 	enum Attr attr;
 	int bg, fg;
 };
 
+// Styles are interned so that each cell stores only a 16-bit ID.
+enum { StylesCap = 1 << 16 };
+static struct {
+	struct Style styles[StylesCap];
+	uint32_t index[2 * StylesCap];
+	uint len;
+} intern;
+
+static bool styleEqual(struct Style a, struct Style b) {
+	return a.attr == b.attr && a.bg == b.bg && a.fg == b.fg;
+}
+
+static uint16_t styleID(struct Style style) {
+	uint32_t mask = 2 * StylesCap - 1;
+	uint32_t i = style.attr * 0x9E3779B1u;
+	i ^= style.bg * 0x85EBCA77u;
+	i ^= style.fg * 0xC2B2AE3Du;
+	i &= mask;
+	for (; intern.index[i]; i = (i + 1) & mask) {
+		uint16_t id = intern.index[i] - 1;
+		if (styleEqual(intern.styles[id], style)) return id;
+	}
+	if (intern.len == StylesCap) {
+		static bool warned;
+		if (!warned) warnx("too many styles");
+		warned = true;
+		return 0;
+	}
+	intern.styles[intern.len] = style;
+	intern.index[i] = ++intern.len;
+	return intern.len - 1;
+}
+
 struct Cell {
-	struct Style style;
+	uint16_t style;
 	wchar_t ch;
 };
 
+struct Buffer {
+	char *ptr;
+	size_t len, cap;
+};
+
+// Rows cache their HTML, which is rendered again only once they are dirty.
+struct Row {
+	bool dirty;
+	size_t version;
+	struct Buffer html;
+	struct Cell cells[];
+};
+
 static uint rows = 24, cols = 80;
-static struct Cell *cells;
+static struct Row **screen;
 
+static struct Row *newRow(void) {
+	struct Row *row = calloc(1, sizeof(*row) + sizeof(*row->cells) * cols);
+	if (!row) err(EX_OSERR, "calloc");
+	row->dirty = true;
+	return row;
+}
+
+// Every write to the grid goes through cell(), which marks the row dirty.
 static struct Cell *cell(uint y, uint x) {
-	assert(y <= rows);
+	assert(y < rows);
 	assert(x <= cols);
-	assert(y * cols + x <= rows * cols);
-	return &cells[y * cols + x];
+	screen[y]->dirty = true;
+	return &screen[y]->cells[x];
 }
 
 static uint y, x;
 static struct Style style = { .bg = -1, .fg = -1 };
+static uint16_t pen;
 
 static struct {
 	uint y, x;
@@ -84,6 +154,11 @@ static uint p(uint i, uint z) {
 	return (i < param.n ? param.s[i] : z);
 }
 
+// Parameters for counts and positions treat 0 as 1.
+static uint p1(uint i) {
+	return (p(i, 1) ? p(i, 1) : 1);
+}
+
 static uint min(uint a, uint b) {
 	return (a < b ? a : b);
 }
@@ -105,26 +180,28 @@ static void csiSep(wchar_t _ch) {
 	param.i++;
 }
 
+// Parameters saturate so that arithmetic on them cannot wrap around.
+enum { ParamMax = 0xFFFF };
+
 static void csiDigit(wchar_t ch) {
-	param.s[param.i] *= 10;
-	param.s[param.i] += ch - L'0';
+	param.s[param.i] = min(10 * param.s[param.i] + ch - L'0', ParamMax);
 	if (!param.n) param.n++;
 }
 
 static void bs(wchar_t _ch)  { if (x) x--; }
 static void ht(wchar_t _ch)  { x = min(x - x % 8 + 8, cols - 1); }
 static void cr(wchar_t _ch)  { x = 0; }
-static void cuu(wchar_t _ch) { y -= min(p(0, 1), y); }
-static void cud(wchar_t _ch) { y  = min(y + p(0, 1), rows - 1); }
-static void cuf(wchar_t _ch) { x  = min(x + p(0, 1), cols - 1); }
-static void cub(wchar_t _ch) { x -= min(p(0, 1), x); }
+static void cuu(wchar_t _ch) { y -= min(p1(0), y); }
+static void cud(wchar_t _ch) { y  = min(y + p1(0), rows - 1); }
+static void cuf(wchar_t _ch) { x  = min(x + p1(0), cols - 1); }
+static void cub(wchar_t _ch) { x -= min(p1(0), x); }
 static void cnl(wchar_t _ch) { x = 0; cud(0); }
 static void cpl(wchar_t _ch) { x = 0; cuu(0); }
-static void cha(wchar_t _ch) { x = min(p(0, 1) - 1, cols - 1); }
-static void vpa(wchar_t _ch) { y = min(p(0, 1) - 1, rows - 1); }
+static void cha(wchar_t _ch) { x = min(p1(0) - 1, cols - 1); }
+static void vpa(wchar_t _ch) { y = min(p1(0) - 1, rows - 1); }
 static void cup(wchar_t _ch) {
-	y = min(p(0, 1) - 1, rows - 1);
-	x = min(p(1, 1) - 1, cols - 1);
+	y = min(p1(0) - 1, rows - 1);
+	x = min(p1(1) - 1, cols - 1);
 }
 static void decsc(wchar_t _ch) {
 	save.y = y;
@@ -141,16 +218,24 @@ static void move(struct Cell *dst, struct Cell *src, size_t len) {
 
 static void erase(struct Cell *at, struct Cell *to) {
 	for (; at < to; ++at) {
-		at->style = style;
+		at->style = pen;
 		at->ch = L' ';
 	}
 }
 
+static void eraseRows(uint top, uint bot) {
+	for (uint i = top; i < bot; ++i) {
+		erase(cell(i, 0), cell(i, cols));
+	}
+}
+
 static void ed(wchar_t _ch) {
 	erase(
-		(p(0, 0) == 0 ? cell(y, x) : cell(0, 0)),
-		(p(0, 0) == 1 ? cell(y, x) : cell(rows - 1, cols))
+		(p(0, 0) == 0 ? cell(y, x) : cell(y, 0)),
+		(p(0, 0) == 1 ? cell(y, x) : cell(y, cols))
 	);
+	if (p(0, 0) != 0) eraseRows(0, y);
+	if (p(0, 0) != 1) eraseRows(y + 1, rows);
 }
 static void el(wchar_t _ch) {
 	erase(
@@ -159,16 +244,16 @@ static void el(wchar_t _ch) {
 	);
 }
 static void ech(wchar_t _ch) {
-	erase(cell(y, x), cell(y, min(x + p(0, 1), cols)));
+	erase(cell(y, x), cell(y, min(x + p1(0), cols)));
 }
 
 static void dch(wchar_t _ch) {
-	uint n = min(p(0, 1), cols - x);
+	uint n = min(p1(0), cols - x);
 	move(cell(y, x), cell(y, x + n), cols - x - n);
 	erase(cell(y, cols - n), cell(y, cols));
 }
 static void ich(wchar_t _ch) {
-	uint n = min(p(0, 1), cols - x);
+	uint n = min(p1(0), cols - x);
 	move(cell(y, x + n), cell(y, x), cols - x - n);
 	erase(cell(y, x), cell(y, x + n));
 }
@@ -177,31 +262,76 @@ static struct {
 	uint top, bot;
 } scroll;
 
-static void scrollUp(uint top, uint n) {
+static struct {
+	struct Row **rows;
+	uint cap, len, head;
+} hist;
+
+// Push a row into the history, returning a row to take its place.
+static struct Row *histPush(struct Row *row) {
+	if (hist.len < hist.cap) {
+		hist.rows[(hist.head + hist.len++) % hist.cap] = row;
+		return newRow();
+	}
+	struct Row *old = hist.rows[hist.head];
+	hist.rows[hist.head] = row;
+	hist.head = (hist.head + 1) % hist.cap;
+	return old;
+}
+
+// Scrolling rotates row pointers rather than moving cells. Rows scrolled
+// off the top of the screen are saved to the history, but not deleted rows.
+static void scrollUp(uint top, uint n, bool save) {
 	n = min(n, scroll.bot - top);
-	move(cell(top, 0), cell(top + n, 0), cols * (scroll.bot - top - n));
-	erase(cell(scroll.bot - n, 0), cell(scroll.bot, 0));
+	if (!n) return;
+	struct Row *temp[n];
+	memcpy(temp, &screen[top], sizeof(*temp) * n);
+	memmove(
+		&screen[top], &screen[top + n],
+		sizeof(*screen) * (scroll.bot - top - n)
+	);
+	for (uint i = 0; i < n; ++i) {
+		if (save && !top && hist.cap) temp[i] = histPush(temp[i]);
+		screen[scroll.bot - n + i] = temp[i];
+	}
+	eraseRows(scroll.bot - n, scroll.bot);
 }
 
 static void scrollDown(uint top, uint n) {
 	n = min(n, scroll.bot - top);
-	move(cell(top + n, 0), cell(top, 0), cols * (scroll.bot - top - n));
-	erase(cell(top, 0), cell(top + n, 0));
+	if (!n) return;
+	struct Row *temp[n];
+	memcpy(temp, &screen[scroll.bot - n], sizeof(*temp) * n);
+	memmove(
+		&screen[top + n], &screen[top],
+		sizeof(*screen) * (scroll.bot - top - n)
+	);
+	memcpy(&screen[top], temp, sizeof(*temp) * n);
+	eraseRows(top, top + n);
 }
 
+// Regions of fewer than two rows are ignored.
 static void decstbm(wchar_t _ch) {
-	scroll.bot = min(p(1, rows), rows);
-	scroll.top = min(p(0, 1) - 1, scroll.bot);
+	uint top = p1(0) - 1;
+	uint bot = min((p(1, 0) ? p(1, 0) : rows), rows);
+	if (top + 1 >= bot) return;
+	scroll.top = top;
+	scroll.bot = bot;
 }
 
-static void su(wchar_t _ch) { scrollUp(scroll.top, p(0, 1)); }
-static void sd(wchar_t _ch) { scrollDown(scroll.top, p(0, 1)); }
-static void dl(wchar_t _ch) { scrollUp(min(y, scroll.bot), p(0, 1)); }
-static void il(wchar_t _ch) { scrollDown(min(y, scroll.bot), p(0, 1)); }
+static void su(wchar_t _ch) { scrollUp(scroll.top, p1(0), true); }
+static void sd(wchar_t _ch) { scrollDown(scroll.top, p1(0)); }
+
+// Lines are only inserted or deleted within the scroll region.
+static bool inScroll(void) {
+	return y >= scroll.top && y < scroll.bot;
+}
+static void dl(wchar_t _ch) { if (inScroll()) scrollUp(y, p1(0), false); }
+static void il(wchar_t _ch) { if (inScroll()) scrollDown(y, p1(0)); }
 
 static void nl(wchar_t _ch) {
 	if (y + 1 == scroll.bot) {
-		scrollUp(scroll.top, 1);
+		scrollUp(scroll.top, 1, true);
 	} else {
 		y = min(y + 1, rows - 1);
 	}
@@ -283,9 +413,32 @@ enum {
 	SetBg8 = 100,
 	SetBgF = 107,
 
+	ColorRGB = 2,
 	Color256 = 5,
 };
 
+static int sgrColor(uint *i, uint n, int color) {
+	if (++*i >= n) return color;
+	switch (param.s[*i]) {
+		break; case Color256: {
+			if (++*i < n) color = min(param.s[*i], 255);
+		}
+		break; case ColorRGB: {
+			if (*i + 3 >= n) {
+				*i = n;
+				break;
+			}
+			color = TrueColor
+				| min(param.s[*i + 1], 255) << 16
+				| min(param.s[*i + 2], 255) << 8
+				| min(param.s[*i + 3], 255);
+			*i += 3;
+		}
+		break; default: warnx("unhandled SGR color %u", param.s[*i]);
+	}
+	return color;
+}
+
 static void sgr(wchar_t _ch) {
 	uint n = param.i + 1;
 	for (uint i = 0; i < n; ++i) {
@@ -305,16 +458,8 @@ static void sgr(wchar_t _ch) {
 			break; case UnsetBlink:     style.attr &= ~Blink;
 			break; case UnsetReverse:   style.attr &= ~Reverse;
 
-			break; case SetFg: {
-				if (++i < n && param.s[i] == Color256) {
-					if (++i < n) style.fg = param.s[i];
-				}
-			}
-			break; case SetBg: {
-				if (++i < n && param.s[i] == Color256) {
-					if (++i < n) style.bg = param.s[i];
-				}
-			}
+			break; case SetFg: style.fg = sgrColor(&i, n, style.fg);
+			break; case SetBg: style.bg = sgrColor(&i, n, style.bg);
 
 			break; case ResetFg: style.fg = -1;
 			break; case ResetBg: style.bg = -1;
@@ -335,6 +480,7 @@ static void sgr(wchar_t _ch) {
 			}
 		}
 	}
+	pen = styleID(style);
 }
 
 static enum {
@@ -354,39 +500,76 @@ static const wchar_t AltCharset[128] = {
 	['~'] = L'·',
 };
 
+// Cache wcwidth(3) for the BMP, offset by 2 so that 0 is unknown.
+static int charWidth(wchar_t ch) {
+	static signed char cache[0x10000];
+	if ((uint)ch >= 0x10000) return wcwidth(ch);
+	if (!cache[ch]) cache[ch] = 2 + wcwidth(ch);
+	return cache[ch] - 2;
+}
+
 static void add(wchar_t ch) {
 	if (charset == DECSpecial && ch < 128 && AltCharset[ch]) {
 		ch = AltCharset[ch];
 	}
 
-	int width = wcwidth(ch);
+	int width = charWidth(ch);
 	if (width < 0) {
 		warnx("unhandled \\u%02X", ch);
 		return;
 	}
+	// Cells hold one character, so zero-width characters are dropped
+	// rather than given a cell or wrapping the line.
+	if (!width) return;
 
 	if (mode & Insert) {
 		uint n = min(width, cols - x);
 		move(cell(y, x + n), cell(y, x), cols - x - n);
 	}
-	if (mode & Wrap && x + width > cols) {
-		cr(0);
-		nl(0);
+	// Without wrap, characters past the margin overwrite the last column.
+	if (x >= cols || x + width > cols) {
+		if (mode & Wrap) {
+			cr(0);
+			nl(0);
+		} else {
+			x = cols - min(width, cols);
+		}
 	}
 
-	cell(y, x)->style = style;
+	cell(y, x)->style = pen;
 	cell(y, x)->ch = ch;
 	for (int i = 1; i < width && x + i < cols; ++i) {
-		cell(y, x + i)->style = style;
+		cell(y, x + i)->style = pen;
 		cell(y, x + i)->ch = L'\0';
 	}
 	x = min(x + width, (mode & Wrap ? cols : cols - 1));
 }
 
-static void html(void);
+// Add a run of printable ASCII, filling whole rows at a time where possible.
+static void addASCII(const char *str, size_t len) {
+	while (len) {
+		bool slow = (charset != USASCII || mode & Insert || !(mode & Wrap));
+		if (slow || x >= cols) {
+			add(*str++);
+			len--;
+			continue;
+		}
+		uint n = min(len, cols - x);
+		struct Cell *at = cell(y, x);
+		for (uint i = 0; i < n; ++i) {
+			at[i].style = pen;
+			at[i].ch = str[i];
+		}
+		x += n;
+		str += n;
+		len -= n;
+	}
+}
+
+static void snapshot(void);
 static void mc(wchar_t _ch) {
 	if (p(0, 0) == 10) {
-		html();
+		snapshot();
 	} else {
 		warnx("unhandled CSI %u MC", p(0, 0));
 	}
@@ -546,80 +729,692 @@ static bool bright;
 static int defaultBg = 0;
 static int defaultFg = 7;
 
-static void span(const struct Style *prev, const struct Cell *cell) {
-	struct Style style = cell->style;
-	if (!prev || memcmp(prev, &style, sizeof(*prev))) {
-		if (prev) printf("</span>");
-		if (style.bg < 0) style.bg = defaultBg;
-		if (style.fg < 0) style.fg = defaultFg;
-		if (bright && style.attr & Bold) {
-			if (style.fg < 8) style.fg += 8;
-			style.attr ^= Bold;
-		}
-		printf(
-			"<span style=\"%s%s%s\" class=\"bg%u fg%u\">",
-			(style.attr & Bold ? "font-weight:bold;" : ""),
-			(style.attr & Italic ? "font-style:italic;" : ""),
-			(style.attr & Underline ? "text-decoration:underline;" : ""),
-			(style.attr & Reverse ? style.fg : style.bg),
-			(style.attr & Reverse ? style.bg : style.fg)
-		);
+static char *bufferReserve(struct Buffer *buf, size_t len) {
+	if (buf->len + len > buf->cap) {
+		if (!buf->cap) buf->cap = 4096;
+		while (buf->len + len > buf->cap) buf->cap *= 2;
+		buf->ptr = realloc(buf->ptr, buf->cap);
+		if (!buf->ptr) err(EX_OSERR, "realloc");
 	}
-	switch (cell->ch) {
-		break; case '&': printf("&amp;");
-		break; case '<': printf("&lt;");
-		break; case '>': printf("&gt;");
-		break; default:  printf("%lc", (wint_t)cell->ch);
+	return &buf->ptr[buf->len];
+}
+
+static void bufferPut(struct Buffer *buf, const char *ptr, size_t len) {
+	memcpy(bufferReserve(buf, len), ptr, len);
+	buf->len += len;
+}
+
+static void bufferString(struct Buffer *buf, const char *str) {
+	bufferPut(buf, str, strlen(str));
+}
+
+static void bufferFormat(struct Buffer *buf, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	va_start(ap, format);
+	vsnprintf(bufferReserve(buf, len + 1), len + 1, format, ap);
+	va_end(ap);
+	buf->len += len;
+}
+
+static void bufferChar(struct Buffer *buf, wchar_t ch) {
+	char *ptr = bufferReserve(buf, 4);
+	if (ch < 0x80) {
+		*ptr++ = ch;
+	} else if (ch < 0x800) {
+		*ptr++ = 0xC0 | ch >> 6;
+		*ptr++ = 0x80 | (ch & 0x3F);
+	} else if (ch < 0x10000) {
+		*ptr++ = 0xE0 | ch >> 12;
+		*ptr++ = 0x80 | (ch >> 6 & 0x3F);
+		*ptr++ = 0x80 | (ch & 0x3F);
+	} else {
+		*ptr++ = 0xF0 | ch >> 18;
+		*ptr++ = 0x80 | (ch >> 12 & 0x3F);
+		*ptr++ = 0x80 | (ch >> 6 & 0x3F);
+		*ptr++ = 0x80 | (ch & 0x3F);
+	}
+	buf->len = ptr - buf->ptr;
+}
+
+static void bufferWrite(struct Buffer *buf) {
+	for (size_t off = 0; off < buf->len;) {
+		ssize_t len = write(STDOUT_FILENO, &buf->ptr[off], buf->len - off);
+		if (len < 0) err(EX_IOERR, "write");
+		off += len;
 	}
+	buf->len = 0;
+}
+
+// Resolve defaults, bright and reverse into the colors to output.
+static struct Style styleOutput(struct Style style) {
+	if (style.bg < 0) style.bg = defaultBg;
+	if (style.fg < 0) style.fg = defaultFg;
+	if (bright && style.attr & Bold) {
+		if (style.fg < 8) style.fg += 8;
+		style.attr ^= Bold;
+	}
+	if (style.attr & Reverse) {
+		int fg = style.fg;
+		style.fg = style.bg;
+		style.bg = fg;
+	}
+	return style;
+}
+
+// Palette colors use the classes from scheme(1), and attributes and direct
+// colors are inline, so that outputs can be included in one page.
+static void span(struct Buffer *buf, uint16_t id) {
+	struct Style style = styleOutput(intern.styles[id]);
+	bufferString(buf, "<span style=\"");
+	if (style.attr & Bold) bufferString(buf, "font-weight:bold;");
+	if (style.attr & Italic) bufferString(buf, "font-style:italic;");
+	if (style.attr & Underline) {
+		bufferString(buf, "text-decoration:underline;");
+	}
+	if (style.bg & TrueColor) {
+		bufferFormat(buf, "background-color:#%06X;", style.bg & 0xFFFFFF);
+	}
+	if (style.fg & TrueColor) {
+		bufferFormat(buf, "color:#%06X;", style.fg & 0xFFFFFF);
+	}
+	bufferString(buf, "\" class=\"");
+	if (style.bg < TrueColor) bufferFormat(buf, "bg%u", style.bg);
+	if (style.bg < TrueColor && style.fg < TrueColor) bufferString(buf, " ");
+	if (style.fg < TrueColor) bufferFormat(buf, "fg%u", style.fg);
+	bufferString(buf, "\">");
+}
+
+// Coalesce cells of the same style into one span, and leave cells of the
+// default style outside of any span.
+static void htmlRow(struct Buffer *buf, const struct Cell *row) {
+	bool open = false;
+	uint16_t prev = 0;
+	for (uint x = 0; x < cols; ++x) {
+		const struct Cell *cell = &row[x];
+		if (!cell->ch) continue;
+		if (cell->style != prev) {
+			if (open) bufferString(buf, "</span>");
+			open = (cell->style != 0);
+			if (open) span(buf, cell->style);
+			prev = cell->style;
+		}
+		switch (cell->ch) {
+			break; case '&': bufferString(buf, "&amp;");
+			break; case '<': bufferString(buf, "&lt;");
+			break; case '>': bufferString(buf, "&gt;");
+			break; default:  bufferChar(buf, cell->ch);
+		}
+	}
+	if (open) bufferString(buf, "</span>");
+	bufferString(buf, "\n");
+}
+
+// Render a dirty row, bumping its version only if its HTML changed.
+static const struct Buffer *rowHTML(struct Row *row) {
+	static struct Buffer buf;
+	if (!row->dirty) return &row->html;
+	row->dirty = false;
+	buf.len = 0;
+	htmlRow(&buf, row->cells);
+	if (buf.len == row->html.len && !memcmp(buf.ptr, row->html.ptr, buf.len)) {
+		return &row->html;
+	}
+	struct Buffer swap = row->html;
+	row->html = buf;
+	buf = swap;
+	row->version++;
+	return &row->html;
 }
 
 static bool mediaCopy;
+static struct Buffer frame;
+
+static void htmlPut(struct Row *row) {
+	const struct Buffer *html = rowHTML(row);
+	bufferPut(&frame, html->ptr, html->len);
+}
+
 static void html(void) {
-	mediaCopy = true;
-	if (mode & Cursor) cell(y, x)->style.attr ^= Reverse;
-	printf(
-		"<pre style=\"width: %uch;\" class=\"bg%u fg%u\">",
+	bufferFormat(
+		&frame, "<pre style=\"width: %uch;\" class=\"bg%u fg%u\">",
 		cols, defaultBg, defaultFg
 	);
+	for (uint i = 0; i < hist.len; ++i) {
+		htmlPut(hist.rows[(hist.head + i) % hist.cap]);
+	}
+	for (uint y = 0; y < rows; ++y) {
+		htmlPut(screen[y]);
+	}
+	bufferString(&frame, "</pre>\n");
+	bufferWrite(&frame);
+}
+
+static void jsonString(struct Buffer *buf, const char *str, size_t len) {
+	bufferString(buf, "\"");
+	for (size_t i = 0; i < len; ++i) {
+		switch (str[i]) {
+			break; case '"':  bufferString(buf, "\\\"");
+			break; case '\\': bufferString(buf, "\\\\");
+			break; case '\n': bufferString(buf, "\\n");
+			break; default: {
+				if ((unsigned char)str[i] < ' ') {
+					bufferFormat(buf, "\\u%04x", str[i]);
+				} else {
+					bufferPut(buf, &str[i], 1);
+				}
+			}
+		}
+	}
+	bufferString(buf, "\"");
+}
+
+static bool json;
+static bool recorded;
+static uint64_t recordTime;
+static uint keyframes = 100;
+static size_t offset;
+
+// Output a frame as a JSON object on one line. Rows unchanged since the
+// previous frame output are omitted, except in every keyframe.
+static void jsonFrame(size_t index) {
+	static size_t count;
+	static struct {
+		const struct Row *row;
+		size_t version;
+	} *prev;
+	if (!prev) {
+		prev = calloc(rows, sizeof(*prev));
+		if (!prev) err(EX_OSERR, "calloc");
+	}
+
+	bool key = !keyframes || !(count++ % keyframes);
+	bufferFormat(&frame, "{\"frame\":%zu,\"offset\":%zu,", index, offset);
+	if (recorded) {
+		bufferFormat(
+			&frame, "\"time\":%" PRIu64 ".%06" PRIu64 ",",
+			recordTime / 1000000, recordTime % 1000000
+		);
+	}
+	bufferFormat(
+		&frame, "\"key\":%s,\"rows\":{", (key ? "true" : "false")
+	);
+	const char *sep = "";
 	for (uint y = 0; y < rows; ++y) {
-		for (uint x = 0; x < cols; ++x) {
-			if (!cell(y, x)->ch) continue;
-			span(x ? &cell(y, x - 1)->style : NULL, cell(y, x));
+		const struct Buffer *row = rowHTML(screen[y]);
+		const struct Row *old = prev[y].row;
+		bool same = (old == screen[y] && prev[y].version == old->version);
+		// A row scrolled into place may still match what was there.
+		if (!same && old && prev[y].version == old->version) {
+			same = (
+				row->len == old->html.len &&
+				!memcmp(row->ptr, old->html.ptr, row->len)
+			);
 		}
-		printf("</span>\n");
+		if (key || !same) {
+			bufferFormat(&frame, "%s\"%u\":", sep, y);
+			jsonString(&frame, row->ptr, row->len);
+			sep = ",";
+		}
+		prev[y].row = screen[y];
+		prev[y].version = screen[y]->version;
 	}
-	printf("</pre>\n");
-	if (mode & Cursor) cell(y, x)->style.attr ^= Reverse;
+	bufferString(&frame, "}}\n");
+	bufferWrite(&frame);
+}
+
+// Draw the cursor, returning the style to restore afterwards.
+static uint16_t cursorShow(void) {
+	uint16_t cursor = cell(y, min(x, cols - 1))->style;
+	if (mode & Cursor) {
+		struct Style style = intern.styles[cursor];
+		style.attr ^= Reverse;
+		cell(y, min(x, cols - 1))->style = styleID(style);
+	}
+	return cursor;
+}
+
+static void cursorHide(uint16_t cursor) {
+	cell(y, min(x, cols - 1))->style = cursor;
+}
+
+// Frames are numbered in the order they occur. If any indices are
+// requested, only those frames are output.
+static size_t frames;
+static struct {
+	size_t *ptr;
+	size_t len;
+	size_t next;
+} indices;
+
+static void snapshot(void) {
+	mediaCopy = true;
+	size_t index = frames++;
+	if (indices.len) {
+		if (indices.next == indices.len) return;
+		if (indices.ptr[indices.next] != index) return;
+		while (
+			indices.next < indices.len && indices.ptr[indices.next] == index
+		) {
+			indices.next++;
+		}
+	}
+	uint16_t cursor = cursorShow();
+	if (json) {
+		jsonFrame(index);
+	} else {
+		html();
+	}
+	cursorHide(cursor);
+}
+
+// In live mode, the screen is published after each read into a copy from
+// which requests are answered, so the parser never waits on clients. Each
+// published row records the sequence number at which it last changed.
+static size_t seq;
+static struct Published {
+	const struct Row *row;
+	size_t version;
+	size_t seq;
+	struct Buffer html;
+} *published;
+
+static void publish(void) {
+	if (!published) {
+		published = calloc(rows, sizeof(*published));
+		if (!published) err(EX_OSERR, "calloc");
+	}
+	bool changed = false;
+	uint16_t cursor = cursorShow();
+	for (uint y = 0; y < rows; ++y) {
+		struct Published *pub = &published[y];
+		const struct Buffer *row = rowHTML(screen[y]);
+		if (pub->row == screen[y] && pub->version == screen[y]->version) {
+			continue;
+		}
+		pub->row = screen[y];
+		pub->version = screen[y]->version;
+		if (
+			row->len == pub->html.len &&
+			!memcmp(row->ptr, pub->html.ptr, row->len)
+		) continue;
+		pub->html.len = 0;
+		bufferPut(&pub->html, row->ptr, row->len);
+		pub->seq = seq + 1;
+		changed = true;
+	}
+	cursorHide(cursor);
+	if (changed) seq++;
+}
+
+// Answer a request for the rows changed since a sequence number, or for
+// all rows if it is 0.
+static void reply(struct Buffer *buf, size_t since) {
+	bufferFormat(buf, "{\"seq\":%zu,\"rows\":{", seq);
+	const char *sep = "";
+	for (uint y = 0; y < rows; ++y) {
+		if (published[y].seq <= since) continue;
+		bufferFormat(buf, "%s\"%u\":", sep, y);
+		jsonString(buf, published[y].html.ptr, published[y].html.len);
+		sep = ",";
+	}
+	bufferString(buf, "}}\n");
+}
+
+enum { RequestCap = 256, ReplyCap = 1024 * 1024 };
+
+static struct Client {
+	struct Buffer in, out;
+} *clients;
+static struct pollfd *fds;
+static size_t nfds = 2;
+
+static void clientAccept(int server) {
+	int fd = accept(server, NULL, NULL);
+	if (fd < 0) {
+		warn("accept");
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	size_t cap = nfds + 1;
+	fds = realloc(fds, sizeof(*fds) * cap);
+	if (!fds) err(EX_OSERR, "realloc");
+	clients = realloc(clients, sizeof(*clients) * cap);
+	if (!clients) err(EX_OSERR, "realloc");
+	fds[nfds] = (struct pollfd) { .fd = fd, .events = POLLIN };
+	clients[nfds] = (struct Client) {0};
+	nfds++;
+}
+
+static void clientClose(size_t i) {
+	close(fds[i].fd);
+	free(clients[i].in.ptr);
+	free(clients[i].out.ptr);
+	fds[i] = fds[--nfds];
+	clients[i] = clients[nfds];
+}
+
+// Read requests and write replies without blocking, closing clients which
+// send overlong requests or do not read their replies.
+static bool clientService(size_t i) {
+	struct Client *client = &clients[i];
+	if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+		char *ptr = bufferReserve(&client->in, RequestCap);
+		ssize_t len = read(fds[i].fd, ptr, RequestCap);
+		if (len < 0 && errno != EAGAIN) return false;
+		if (!len) return false;
+		if (len > 0) client->in.len += len;
+	}
+	char *line;
+	while (NULL != (line = memchr(client->in.ptr, '\n', client->in.len))) {
+		*line++ = '\0';
+		reply(&client->out, strtoull(client->in.ptr, NULL, 10));
+		client->in.len -= line - client->in.ptr;
+		memmove(client->in.ptr, line, client->in.len);
+	}
+	if (client->in.len >= RequestCap) return false;
+	if (client->out.len) {
+		ssize_t len = write(fds[i].fd, client->out.ptr, client->out.len);
+		if (len < 0 && errno != EAGAIN) return false;
+		if (len > 0) {
+			client->out.len -= len;
+			memmove(client->out.ptr, &client->out.ptr[len], client->out.len);
+		}
+	}
+	if (client->out.len > ReplyCap) return false;
+	fds[i].events = (client->out.len ? POLLIN | POLLOUT : POLLIN);
+	return true;
+}
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+static void handler(int sig) {
+	unlink(addr.sun_path);
+	_exit(-sig);
+}
+
+static int listenPath(const char *path) {
+	int server = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) err(EX_OSERR, "socket");
+	fcntl(server, F_SETFD, FD_CLOEXEC);
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	int error = bind(server, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) err(EX_CANTCREAT, "%s", path);
+	signal(SIGINT, handler);
+	signal(SIGTERM, handler);
+	signal(SIGPIPE, SIG_IGN);
+	error = listen(server, SOMAXCONN);
+	if (error) err(EX_OSERR, "listen");
+	return server;
+}
+
+// Publish the screen and serve clients until input is readable, then read
+// it. Once input is closed, pass -1 to serve clients indefinitely.
+static ssize_t serve(int server, int fd, char *buf, size_t cap) {
+	publish();
+	if (!fds) {
+		fds = calloc(nfds, sizeof(*fds));
+		if (!fds) err(EX_OSERR, "calloc");
+		clients = calloc(nfds, sizeof(*clients));
+		if (!clients) err(EX_OSERR, "calloc");
+		fds[0] = (struct pollfd) { .fd = server, .events = POLLIN };
+	}
+	fds[1] = (struct pollfd) { .fd = fd, .events = POLLIN };
+	for (;;) {
+		int n = poll(fds, nfds, -1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) err(EX_IOERR, "poll");
+		for (size_t i = nfds - 1; i >= 2; --i) {
+			if (!fds[i].revents) continue;
+			if (!clientService(i)) clientClose(i);
+		}
+		if (fds[0].revents) clientAccept(server);
+		if (fds[1].revents) return read(fd, buf, cap);
+	}
+}
+
+static int compareOffset(const void *_a, const void *_b) {
+	const size_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static int compareTime(const void *_a, const void *_b) {
+	const uint64_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static bool ascii(char ch) {
+	return ch >= ' ' && ch < DEL;
+}
+
+static bool debug;
+static struct {
+	size_t *ptr;
+	size_t len;
+	size_t next;
+} offsets;
+
+static void consume(const char *buf, size_t len) {
+	static mbstate_t mbs;
+	for (size_t i = 0, n; i < len; i += n) {
+		for (; offsets.next < offsets.len; ++offsets.next) {
+			if (offsets.ptr[offsets.next] > offset) break;
+			snapshot();
+		}
+		size_t stop = len - i;
+		if (offsets.next < offsets.len) {
+			size_t until = offsets.ptr[offsets.next] - offset;
+			if (until < stop) stop = until;
+		}
+
+		// Printable ASCII in Data state only ever reaches add().
+		if (state == Data && ascii(buf[i]) && mbsinit(&mbs)) {
+			for (n = 1; n < stop && ascii(buf[i + n]); ++n);
+			addASCII(&buf[i], n);
+			offset += n;
+			continue;
+		}
+
+		wchar_t ch;
+		n = mbrtowc(&ch, &buf[i], len - i, &mbs);
+		if (n == (size_t)-2) {
+			n = len - i;
+			offset += n;
+			continue;
+		}
+		if (n == (size_t)-1) {
+			memset(&mbs, 0, sizeof(mbs));
+			ch = L'\uFFFD';
+			n = 1;
+		}
+		if (!n) n = 1;
+		offset += n;
+
+		uint prev = state;
+		update(ch);
+		if (debug && state != prev && state == Data) snapshot();
+	}
+}
+
+// Recordings written by ptee -r are inflated a block at a time, and their
+// chunks consumed in order. The index is not needed to play them through.
+static struct {
+	uint64_t *ptr;
+	size_t len;
+	size_t next;
+} times;
+
+static uint64_t get(const uint8_t *ptr, size_t len) {
+	uint64_t n = 0;
+	for (size_t i = 0; i < len; ++i) {
+		n = n << 8 | ptr[i];
+	}
+	return n;
+}
+
+// Fill the buffer, returning its length, which is short only at EOF.
+static size_t readFull(int fd, void *ptr, size_t len) {
+	size_t full = 0;
+	while (full < len) {
+		ssize_t n = read(fd, (uint8_t *)ptr + full, len - full);
+		if (n < 0) err(EX_IOERR, "read");
+		if (!n) break;
+		full += n;
+	}
+	return full;
+}
+
+static void playChunks(const uint8_t *ptr, size_t len) {
+	while (len) {
+		if (len < 12) errx(EX_DATAERR, "truncated chunk");
+		uint64_t time = get(&ptr[0], 8);
+		size_t n = get(&ptr[8], 4);
+		ptr += 12;
+		len -= 12;
+		if (n > len) errx(EX_DATAERR, "truncated chunk");
+		for (; times.next < times.len; ++times.next) {
+			if (times.ptr[times.next] >= time) break;
+			snapshot();
+		}
+		recordTime = time;
+		consume((const char *)ptr, n);
+		ptr += n;
+		len -= n;
+	}
+}
+
+// Play blocks until the index, or until the end of a recording which was
+// interrupted before its index was written.
+static void play(int fd) {
+	struct {
+		uint8_t *ptr;
+		size_t cap;
+	} data = {0}, block = {0};
+	for (;;) {
+		uint8_t head[8];
+		size_t n = readFull(fd, head, sizeof(head));
+		if (!n) break;
+		if (n < sizeof(head)) {
+			warnx("truncated recording");
+			break;
+		}
+		size_t dataLen = get(&head[0], 4);
+		size_t blockLen = get(&head[4], 4);
+		if (!dataLen) break;
+
+		if (dataLen > data.cap) {
+			data.cap = dataLen;
+			data.ptr = realloc(data.ptr, data.cap);
+			if (!data.ptr) err(EX_OSERR, "realloc");
+		}
+		if (blockLen > block.cap) {
+			block.cap = blockLen;
+			block.ptr = realloc(block.ptr, block.cap);
+			if (!block.ptr) err(EX_OSERR, "realloc");
+		}
+		if (readFull(fd, data.ptr, dataLen) < dataLen) {
+			warnx("truncated recording");
+			break;
+		}
+		uLongf len = blockLen;
+		int error = uncompress(block.ptr, &len, data.ptr, dataLen);
+		if (error != Z_OK || len != blockLen) {
+			errx(EX_DATAERR, "uncompress: %d", error);
+		}
+		playChunks(block.ptr, len);
+	}
+	free(data.ptr);
+	free(block.ptr);
+}
+
+// Open a file or FIFO for reading, or connect to a socket.
+static int input(const char *path) {
+	struct stat st;
+	int error = stat(path, &st);
+	if (error || !S_ISSOCK(st.st_mode)) return open(path, O_RDONLY);
+	int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) err(EX_OSERR, "socket");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) {
+		close(sock);
+		return -1;
+	}
+	shutdown(sock, SHUT_WR);
+	return sock;
 }
 
 int main(int argc, char *argv[]) {
 	setlocale(LC_CTYPE, "");
 
-	bool debug = false;
 	bool size = false;
+	uint height = 0, width = 0;
 	bool hide = false;
+	const char *live = NULL;
+
+	indices.ptr = calloc(argc, sizeof(*indices.ptr));
+	if (!indices.ptr) err(EX_OSERR, "calloc");
+	offsets.ptr = calloc(argc, sizeof(*offsets.ptr));
+	if (!offsets.ptr) err(EX_OSERR, "calloc");
+	times.ptr = calloc(argc, sizeof(*times.ptr));
+	if (!times.ptr) err(EX_OSERR, "calloc");
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "Bb:df:h:nsw:"))) {
+	while (0 < (opt = getopt(argc, argv, "BH:b:df:h:i:jk:l:no:st:w:"))) {
 		switch (opt) {
 			break; case 'B': bright = true;
+			break; case 'H': hist.cap = strtoul(optarg, NULL, 0);
 			break; case 'b': defaultBg = strtol(optarg, NULL, 0);
 			break; case 'd': debug = true;
 			break; case 'f': defaultFg = strtol(optarg, NULL, 0);
-			break; case 'h': rows = strtoul(optarg, NULL, 0);
+			break; case 'h': height = strtoul(optarg, NULL, 0);
+			break; case 'i': {
+				indices.ptr[indices.len++] = strtoull(optarg, NULL, 0);
+			}
+			break; case 'j': json = true;
+			break; case 'k': keyframes = strtoul(optarg, NULL, 0);
+			break; case 'l': live = optarg;
 			break; case 'n': hide = true;
+			break; case 'o': {
+				offsets.ptr[offsets.len++] = strtoull(optarg, NULL, 0);
+			}
 			break; case 's': size = true;
-			break; case 'w': cols = strtoul(optarg, NULL, 0);
+			break; case 't': {
+				times.ptr[times.len++] = strtod(optarg, NULL) * 1000000;
+			}
+			break; case 'w': width = strtoul(optarg, NULL, 0);
 			break; default:  return EX_USAGE;
 		}
 	}
 
-	FILE *file = stdin;
+	int fd = STDIN_FILENO;
 	if (optind < argc) {
-		file = fopen(argv[optind], "r");
-		if (!file) err(EX_NOINPUT, "%s", argv[optind]);
+		fd = input(argv[optind]);
+		if (fd < 0) err(EX_NOINPUT, "%s", argv[optind]);
 	}
 
+	// Recordings are recognized by their header, which gives the size of
+	// the terminal they were made in.
+	uint8_t head[12];
+	size_t headLen = 0;
+	if (!live) {
+		headLen = readFull(fd, head, sizeof(head));
+		recorded = (
+			headLen == sizeof(head) &&
+			!memcmp(head, "ptee", 4) && get(&head[4], 4) == 1
+		);
+	}
+	if (times.len && !recorded) errx(EX_USAGE, "input is not a recording");
+	if (recorded) {
+		rows = get(&head[8], 2);
+		cols = get(&head[10], 2);
+	}
+	if (height) rows = height;
+	if (width) cols = width;
+
 	if (size) {
 		struct winsize window;
 		int error = ioctl(STDERR_FILENO, TIOCGWINSZ, &window);
@@ -627,22 +1422,52 @@ int main(int argc, char *argv[]) {
 		rows = window.ws_row;
 		cols = window.ws_col;
 	}
+	if (!rows || !cols) errx(EX_USAGE, "invalid terminal size");
 	scroll.bot = rows;
+	pen = styleID(style);
 
-	cells = calloc(rows * cols, sizeof(*cells));
-	if (!cells) err(EX_OSERR, "calloc");
-	erase(cell(0, 0), cell(rows - 1, cols));
+	screen = calloc(rows, sizeof(*screen));
+	if (!screen) err(EX_OSERR, "calloc");
+	for (uint y = 0; y < rows; ++y) {
+		screen[y] = newRow();
+	}
+	eraseRows(0, rows);
 
-	wint_t ch;
-	while (WEOF != (ch = getwc(file))) {
-		uint prev = state;
-		update(ch);
-		if (debug && state != prev && state == Data) html();
+	if (hist.cap) {
+		hist.rows = calloc(hist.cap, sizeof(*hist.rows));
+		if (!hist.rows) err(EX_OSERR, "calloc");
+	}
+
+	qsort(indices.ptr, indices.len, sizeof(*indices.ptr), compareOffset);
+	qsort(offsets.ptr, offsets.len, sizeof(*offsets.ptr), compareOffset);
+	qsort(times.ptr, times.len, sizeof(*times.ptr), compareTime);
+
+	int server = (live ? listenPath(live) : -1);
+	char buf[64 * 1024];
+	ssize_t len = 0;
+	if (recorded) {
+		play(fd);
+	} else if (headLen) {
+		consume((const char *)head, headLen);
+	}
+	while (
+		!recorded && 0 < (len = (
+			live
+			? serve(server, fd, buf, sizeof(buf))
+			: read(fd, buf, sizeof(buf))
+		))
+	) {
+		consume(buf, len);
+	}
+	if (len < 0) err(EX_IOERR, "read");
+	for (; offsets.next < offsets.len; ++offsets.next) {
+		if (offsets.ptr[offsets.next] > offset) break;
+		snapshot();
 	}
-	if (ferror(file)) err(EX_IOERR, "getwc");
 
 	if (!mediaCopy) {
 		if (hide) mode &= ~Cursor;
-		html();
+		snapshot();
 	}
+	if (live) serve(server, -1, buf, sizeof(buf));
 }
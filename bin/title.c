@@ -14,15 +14,27 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <curl/curl.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iconv.h>
+#include <limits.h>
 #include <locale.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -81,65 +93,749 @@ static void showTitle(const char *title) {
 	printf("%s\n", title);
 }
 
-static CURL *curl;
-static bool title;
+// Cache {{{
+
+// Titles are cached by normalized URL for ttl seconds, as are failures
+// and pages without titles, which have no title. Failures keep their error
+// message to report again.
+static time_t ttl = 60 * 60;
+
+struct Entry {
+	const char *key;
+	const char *title;
+	const char *url;
+	const char *error;
+	time_t time;
+	bool owned;
+};
+
 static struct {
-	char buf[8192];
+	struct Entry *ptr;
+	size_t len, cap;
+	size_t hits, misses;
+	double lookup;
+} cache;
+
+static uint64_t hash(const char *str) {
+	uint64_t hash = UINT64_C(0xCBF29CE484222325);
+	for (; *str; ++str) {
+		hash ^= (unsigned char)*str;
+		hash *= UINT64_C(0x100000001B3);
+	}
+	return hash;
+}
+
+static struct Entry *cacheSlot(const char *key) {
+	size_t i = hash(key) & (cache.cap - 1);
+	while (cache.ptr[i].key && strcmp(cache.ptr[i].key, key)) {
+		i = (i + 1) & (cache.cap - 1);
+	}
+	return &cache.ptr[i];
+}
+
+static void cacheFree(struct Entry *entry) {
+	if (!entry->owned) return;
+	free((char *)entry->key);
+	free((char *)entry->title);
+	free((char *)entry->url);
+	free((char *)entry->error);
+}
+
+// Expired entries are dropped while rehashing, and the table only doubles
+// if that does not leave it at most a quarter full.
+static void cacheGrow(void) {
+	struct Entry *old = cache.ptr;
+	size_t cap = cache.cap;
+	time_t expire = time(NULL) - ttl;
+	cache.len = 0;
+	for (size_t i = 0; i < cap; ++i) {
+		if (old[i].key && old[i].time > expire) cache.len++;
+	}
+	cache.cap = (cap ? cap : 256);
+	if (4 * (cache.len + 1) > cache.cap) cache.cap *= 2;
+	cache.ptr = calloc(cache.cap, sizeof(*cache.ptr));
+	if (!cache.ptr) err(EX_OSERR, "calloc");
+	for (size_t i = 0; i < cap; ++i) {
+		if (!old[i].key) continue;
+		if (old[i].time > expire) {
+			*cacheSlot(old[i].key) = old[i];
+		} else {
+			cacheFree(&old[i]);
+		}
+	}
+	free(old);
+}
+
+static void cachePut(struct Entry entry) {
+	if (2 * (cache.len + 1) > cache.cap) cacheGrow();
+	struct Entry *slot = cacheSlot(entry.key);
+	if (slot->key) {
+		if (slot->time > entry.time) {
+			cacheFree(&entry);
+			return;
+		}
+		cacheFree(slot);
+	} else {
+		cache.len++;
+	}
+	*slot = entry;
+}
+
+static void cacheInsert(
+	const char *key, const char *title, const char *url, const char *error
+) {
+	struct Entry entry = {
+		.key = strdup(key),
+		.title = (title ? strdup(title) : NULL),
+		.url = strdup(url),
+		.error = (error ? strdup(error) : NULL),
+		.time = time(NULL),
+		.owned = true,
+	};
+	if (
+		!entry.key || (title && !entry.title) || !entry.url ||
+		(error && !entry.error)
+	) {
+		err(EX_OSERR, "strdup");
+	}
+	cachePut(entry);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const struct Entry *cacheLookup(const char *key) {
+	double start = now();
+	const struct Entry *entry = NULL;
+	if (cache.len) {
+		entry = cacheSlot(key);
+		if (!entry->key || time(NULL) - entry->time >= ttl) entry = NULL;
+	}
+	cache.lookup += now() - start;
+	if (entry) cache.hits++; else cache.misses++;
+	return entry;
+}
+
+// Lower-case the scheme and host, drop default ports and the fragment,
+// and give an empty path a slash.
+static char *normalize(const char *url) {
+	size_t len = strlen(url);
+	char *norm = malloc(len + 2);
+	if (!norm) err(EX_OSERR, "malloc");
+	memcpy(norm, url, len + 1);
+	norm[strcspn(norm, "#")] = '\0';
+
+	char *host = strstr(norm, "://");
+	host = (host ? &host[3] : norm);
+	char *path = &host[strcspn(host, "/?")];
+	for (char *ch = norm; ch < path; ++ch) {
+		*ch = tolower((unsigned char)*ch);
+	}
+
+	static const char *Defaults[][2] = {
+		{ "http://", ":80" },
+		{ "https://", ":443" },
+	};
+	for (size_t i = 0; i < sizeof(Defaults) / sizeof(Defaults[0]); ++i) {
+		size_t scheme = strlen(Defaults[i][0]);
+		size_t port = strlen(Defaults[i][1]);
+		if (strncmp(norm, Defaults[i][0], scheme)) continue;
+		if (path - host <= (ptrdiff_t)port) continue;
+		if (strncmp(path - port, Defaults[i][1], port)) continue;
+		memmove(path - port, path, strlen(path) + 1);
+		path -= port;
+	}
+
+	if (*path != '/') {
+		memmove(&path[1], path, strlen(path) + 1);
+		*path = '/';
+	}
+	return norm;
+}
+
+// The cache file is a header followed by records, each of which is a
+// big-endian 64-bit time and 32-bit lengths of the NUL-terminated key,
+// title, URL and error strings which follow it. The title and error may be
+// absent, with length zero. Entries loaded from it point into
+// the mapping.
+static const char CacheMagic[8] = "title\0\0\3";
+
+typedef unsigned char byte;
+
+struct Record {
+	int64_t time;
+	uint32_t key, title, url, error;
+};
+enum { RecordSize = 8 + 4 * 4 };
+
+static uint32_t get32(const byte *ptr) {
+	return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16
+		| (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+}
+static uint64_t get64(const byte *ptr) {
+	return (uint64_t)get32(&ptr[0]) << 32 | get32(&ptr[4]);
+}
+
+static void put32(byte *ptr, uint32_t n) {
+	ptr[0] = n >> 24;
+	ptr[1] = n >> 16;
+	ptr[2] = n >> 8;
+	ptr[3] = n;
+}
+static void put64(byte *ptr, uint64_t n) {
+	put32(&ptr[0], n >> 32);
+	put32(&ptr[4], n);
+}
+
+static void cacheLoad(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 && errno == ENOENT) return;
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+
+	struct stat stat;
+	int error = fstat(fd, &stat);
+	if (error) err(EX_IOERR, "%s", path);
+	if (!stat.st_size) {
+		close(fd);
+		return;
+	}
+
+	const char *map = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) err(EX_IOERR, "%s", path);
+	close(fd);
+
+	size_t size = stat.st_size;
+	if (
+		size < sizeof(CacheMagic) ||
+		memcmp(map, CacheMagic, sizeof(CacheMagic))
+	) {
+		warnx("%s: not a cache file", path);
+		return;
+	}
+	time_t expire = time(NULL) - ttl;
+	for (size_t at = sizeof(CacheMagic); at < size;) {
+		if (size - at < RecordSize) break;
+		const byte *ptr = (const byte *)&map[at];
+		struct Record rec = {
+			.time = get64(&ptr[0]),
+			.key = get32(&ptr[8]),
+			.title = get32(&ptr[12]),
+			.url = get32(&ptr[16]),
+			.error = get32(&ptr[20]),
+		};
+		at += RecordSize;
+		size_t len = (size_t)rec.key + rec.title + rec.url + rec.error;
+		if (!rec.key || !rec.url || size - at < len) break;
+		const char *key = &map[at];
+		const char *title = &key[rec.key];
+		const char *url = &title[rec.title];
+		const char *error = &url[rec.url];
+		at += len;
+		if (key[rec.key - 1] || url[rec.url - 1]) break;
+		if (rec.title && title[rec.title - 1]) break;
+		if (rec.error && error[rec.error - 1]) break;
+		if (rec.time <= expire) continue;
+		cachePut((struct Entry) {
+			.key = key,
+			.title = (rec.title ? title : NULL),
+			.url = url,
+			.error = (rec.error ? error : NULL),
+			.time = rec.time,
+		});
+	}
+}
+
+static void cacheWrite(FILE *file, const struct Entry *entry) {
+	struct Record rec = {
+		.time = entry->time,
+		.key = strlen(entry->key) + 1,
+		.title = (entry->title ? strlen(entry->title) + 1 : 0),
+		.url = strlen(entry->url) + 1,
+		.error = (entry->error ? strlen(entry->error) + 1 : 0),
+	};
+	byte buf[RecordSize];
+	put64(&buf[0], rec.time);
+	put32(&buf[8], rec.key);
+	put32(&buf[12], rec.title);
+	put32(&buf[16], rec.url);
+	put32(&buf[20], rec.error);
+	fwrite(buf, sizeof(buf), 1, file);
+	fwrite(entry->key, rec.key, 1, file);
+	if (entry->title) fwrite(entry->title, rec.title, 1, file);
+	fwrite(entry->url, rec.url, 1, file);
+	if (entry->error) fwrite(entry->error, rec.error, 1, file);
+}
+
+static void cacheSave(const char *path) {
+	char temp[PATH_MAX];
+	snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) err(EX_CANTCREAT, "%s", temp);
+	FILE *file = fdopen(fd, "w");
+	if (!file) err(EX_CANTCREAT, "%s", temp);
+
+	fwrite(CacheMagic, sizeof(CacheMagic), 1, file);
+	time_t expire = time(NULL) - ttl;
+	for (size_t i = 0; i < cache.cap; ++i) {
+		const struct Entry *entry = &cache.ptr[i];
+		if (entry->key && entry->time > expire) cacheWrite(file, entry);
+	}
+	if (fclose(file)) err(EX_IOERR, "%s", temp);
+
+	int error = rename(temp, path);
+	if (error) err(EX_CANTCREAT, "%s", path);
+}
+
+static void cacheStats(void) {
+	size_t total = cache.hits + cache.misses;
+	if (!total) return;
+	warnx(
+		"%zu hits, %zu misses, %.1f%% hit rate, %.2f us mean lookup",
+		cache.hits, cache.misses, 100.0 * cache.hits / total,
+		cache.lookup / total * 1e6
+	);
+}
+
+// }}}
+
+static CURL *curl;
+static CURLM *multi;
+
+// Titles are fetched concurrently, but output in the order their URLs
+// were read.
+enum { Parallel = 8 };
+
+// Titles are scanned for a byte at a time as the body arrives, and the
+// transfer is stopped once the title is complete.
+enum State {
+	Data,
+	Tag,
+	Attrs,
+	Comment,
+	Text,
+	End,
+	Close,
+	Found,
+};
+
+struct Scan {
+	enum State state;
+	enum { Other, Meta, Title } tag;
+	char name[8];
 	size_t len;
-} body;
+	char attrs[256];
+	size_t attrsLen;
+	char charset[32];
+	char text[2048];
+	size_t textLen;
+};
 
-// HE COMES
-static const char TitlePattern[] = "<title>([^<]*)</title>";
-static regex_t TitleRegex;
+static void charsetParse(char *charset, size_t cap, const char *str) {
+	for (const char *ptr = str; *ptr; ++ptr) {
+		if (strncasecmp(ptr, "charset", 7)) continue;
+		const char *val = &ptr[7];
+		val += strspn(val, " \t");
+		if (*val++ != '=') continue;
+		val += strspn(val, " \t\"'");
+		size_t len = strspn(
+			val,
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+			"0123456789-_.:"
+		);
+		if (!len || len >= cap) return;
+		memcpy(charset, val, len);
+		charset[len] = '\0';
+		return;
+	}
+}
 
-static size_t handleBody(char *buf, size_t size, size_t nitems, void *user) {
-	(void)user;
+static void scanText(struct Scan *scan, char ch) {
+	if (scan->textLen < sizeof(scan->text) - 1) {
+		scan->text[scan->textLen++] = ch;
+	}
+}
+
+static void scanByte(struct Scan *scan, char ch) {
+	static const char EndTag[] = "/title";
+	bool space = isspace((unsigned char)ch);
+	switch (scan->state) {
+		break; case Data: {
+			if (ch != '<') break;
+			scan->state = Tag;
+			scan->len = 0;
+		}
+
+		break; case Tag: {
+			if (ch != '>' && !space && (ch != '/' || !scan->len)) {
+				if (scan->len < sizeof(scan->name) - 1) {
+					scan->name[scan->len++] = tolower((unsigned char)ch);
+				}
+				if (scan->len == 3 && !memcmp(scan->name, "!--", 3)) {
+					scan->state = Comment;
+					scan->len = 0;
+				}
+				break;
+			}
+			scan->name[scan->len] = '\0';
+			if (!strcmp(scan->name, "title")) {
+				scan->tag = Title;
+			} else if (!strcmp(scan->name, "meta")) {
+				scan->tag = Meta;
+			} else {
+				scan->tag = Other;
+			}
+			scan->state = Attrs;
+			scan->attrsLen = 0;
+			scanByte(scan, ch);
+		}
+
+		break; case Attrs: {
+			if (ch != '>') {
+				if (scan->attrsLen < sizeof(scan->attrs) - 1) {
+					scan->attrs[scan->attrsLen++] = ch;
+				}
+				break;
+			}
+			scan->state = Data;
+			if (scan->tag == Meta && !scan->charset[0]) {
+				scan->attrs[scan->attrsLen] = '\0';
+				charsetParse(
+					scan->charset, sizeof(scan->charset), scan->attrs
+				);
+			} else if (scan->tag == Title) {
+				scan->state = Text;
+				scan->textLen = 0;
+			}
+		}
+
+		break; case Comment: {
+			if (ch == '-') {
+				scan->len++;
+			} else if (ch == '>' && scan->len >= 2) {
+				scan->state = Data;
+			} else {
+				scan->len = 0;
+			}
+		}
+
+		break; case Text: {
+			if (ch != '<') {
+				scanText(scan, ch);
+				break;
+			}
+			scan->state = End;
+			scan->len = 0;
+		}
+
+		break; case End: {
+			size_t len = scan->len;
+			if (len < 6 && tolower((unsigned char)ch) == EndTag[len]) {
+				scan->name[scan->len++] = ch;
+			} else if (len == 6 && (ch == '>' || ch == '/' || space)) {
+				scan->state = Close;
+				scanByte(scan, ch);
+			} else {
+				scanText(scan, '<');
+				for (size_t i = 0; i < len; ++i) {
+					scanText(scan, scan->name[i]);
+				}
+				scan->state = Text;
+				scanByte(scan, ch);
+			}
+		}
+
+		break; case Close: if (ch == '>') scan->state = Found;
+		break; case Found:;
+	}
+}
+
+// Convert the title to UTF-8 from the charset given by the Content-Type
+// header or a meta tag, or leave it as is.
+static char *scanTitle(const struct Scan *scan) {
+	const char *charset = scan->charset;
+	if (
+		!charset[0] ||
+		!strcasecmp(charset, "utf-8") ||
+		!strcasecmp(charset, "utf8")
+	) {
+		return strndup(scan->text, scan->textLen);
+	}
+
+	iconv_t conv = iconv_open("UTF-8", charset);
+	if (conv == (iconv_t)-1) return strndup(scan->text, scan->textLen);
+
+	size_t cap = 4 * scan->textLen + 1;
+	char *title = malloc(cap);
+	if (!title) err(EX_OSERR, "malloc");
+
+	char *in = (char *)scan->text;
+	size_t inLen = scan->textLen;
+	char *out = title;
+	size_t outLen = cap - 1;
+	size_t n = iconv(conv, &in, &inLen, &out, &outLen);
+	iconv_close(conv);
+	if (n == (size_t)-1) {
+		free(title);
+		return strndup(scan->text, scan->textLen);
+	}
+	*out = '\0';
+	return title;
+}
+
+struct Fetch {
+	struct Fetch *next;
+	CURL *curl;
+	char error[CURL_ERROR_SIZE];
+	bool done;
+	bool skip;
+	char *key;
+	char *title;
+	struct Scan scan;
+};
+
+static struct {
+	struct Fetch *head, **tail;
+	struct Fetch *pending;
+	size_t active;
+} fetches = { .tail = &fetches.head };
+
+// Once the final response's headers are in, skip anything but HTML rather
+// than reading its body.
+static size_t handleHeader(char *buf, size_t size, size_t nitems, void *user) {
+	struct Fetch *fetch = user;
 	size_t len = size * nitems;
-	size_t cap = sizeof(body.buf) - body.len - 1;
-	size_t new = (len < cap ? len : cap);
-	if (title || !new) return len;
+	if (len > 2 || strspn(buf, "\r\n") != len) return len;
 
-	memcpy(&body.buf[body.len], buf, new);
-	body.len += new;
-	body.buf[body.len] = '\0';
+	long status;
+	curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &status);
+	if (status < 200 || status >= 300) return len;
 
-	regmatch_t match[2];
-	if (regexec(&TitleRegex, body.buf, 2, match, 0)) return len;
-	body.buf[match[1].rm_eo] = '\0';
-	showTitle(&body.buf[match[1].rm_so]);
-	title = true;
+	char *type;
+	CURLcode code;
+	code = curl_easy_getinfo(fetch->curl, CURLINFO_CONTENT_TYPE, &type);
+	if (!code && type && !strncmp(type, "text/html", 9)) {
+		charsetParse(fetch->scan.charset, sizeof(fetch->scan.charset), type);
+		return len;
+	}
+	fetch->skip = true;
+	return 0;
+}
 
+static size_t handleBody(char *buf, size_t size, size_t nitems, void *user) {
+	struct Fetch *fetch = user;
+	size_t len = size * nitems;
+	for (size_t i = 0; i < len; ++i) {
+		scanByte(&fetch->scan, buf[i]);
+		if (fetch->scan.state != Found) continue;
+		fetch->title = scanTitle(&fetch->scan);
+		if (!fetch->title) err(EX_OSERR, "strndup");
+		return 0;
+	}
 	return len;
 }
 
-static CURLcode fetchTitle(const char *url) {
-	CURLcode code = curl_easy_setopt(curl, CURLOPT_URL, url);
-	if (code) return code;
+// Failures are marked by an error message, which libcurl does not always
+// write.
+static void fetchFail(struct Fetch *fetch, CURLcode code) {
+	if (fetch->error[0]) return;
+	snprintf(
+		fetch->error, sizeof(fetch->error), "%s", curl_easy_strerror(code)
+	);
+}
+
+static void fetchTitle(const char *url) {
+	struct Fetch *fetch = calloc(1, sizeof(*fetch));
+	if (!fetch) err(EX_OSERR, "calloc");
+	*fetches.tail = fetch;
+	fetches.tail = &fetch->next;
+	if (!fetches.pending) fetches.pending = fetch;
 
-	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-	code = curl_easy_perform(curl);
-	if (code) return code;
+	fetch->key = normalize(url);
+	const struct Entry *entry = cacheLookup(fetch->key);
+	if (entry) {
+		fetch->done = true;
+		if (entry->error) {
+			snprintf(fetch->error, sizeof(fetch->error), "%s", entry->error);
+		}
+		if (!entry->title) return;
+		fetch->title = strdup(entry->title);
+		if (!fetch->title) err(EX_OSERR, "strdup");
+		return;
+	}
 
-	char *type;
-	code = curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &type);
-	if (code) return code;
-	if (!type || strncmp(type, "text/html", 9)) return CURLE_OK;
+	fetch->curl = curl_easy_duphandle(curl);
+	if (!fetch->curl) errx(EX_SOFTWARE, "curl_easy_duphandle");
+	curl_easy_setopt(fetch->curl, CURLOPT_PRIVATE, fetch);
+	curl_easy_setopt(fetch->curl, CURLOPT_ERRORBUFFER, fetch->error);
+	curl_easy_setopt(fetch->curl, CURLOPT_HEADERDATA, fetch);
+	curl_easy_setopt(fetch->curl, CURLOPT_WRITEDATA, fetch);
+	CURLcode code = curl_easy_setopt(fetch->curl, CURLOPT_URL, url);
+	if (code) {
+		fetch->done = true;
+		fetchFail(fetch, code);
+	}
+}
+
+static void fetchStart(void) {
+	while (fetches.pending && fetches.active < Parallel) {
+		struct Fetch *fetch = fetches.pending;
+		fetches.pending = fetch->next;
+		if (fetch->done) continue;
+		CURLMcode code = curl_multi_add_handle(multi, fetch->curl);
+		if (code) {
+			errx(
+				EX_SOFTWARE, "curl_multi_add_handle: %s",
+				curl_multi_strerror(code)
+			);
+		}
+		fetches.active++;
+	}
+}
+
+static void fetchDone(void) {
+	CURLMsg *msg;
+	int n;
+	while (NULL != (msg = curl_multi_info_read(multi, &n))) {
+		if (msg->msg != CURLMSG_DONE) continue;
+		struct Fetch *fetch;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&fetch);
+		curl_multi_remove_handle(multi, fetch->curl);
+		fetch->done = true;
+		fetches.active--;
+		if (msg->data.result && !fetch->skip) {
+			fetchFail(fetch, msg->data.result);
+		} else {
+			fetch->error[0] = '\0';
+		}
+
+		char *url;
+		const char *error = (fetch->error[0] ? fetch->error : NULL);
+		curl_easy_getinfo(fetch->curl, CURLINFO_EFFECTIVE_URL, &url);
+		cacheInsert(fetch->key, fetch->title, (url ? url : fetch->key), error);
+		if (url && strcmp(url, fetch->key)) {
+			char *key = normalize(url);
+			cacheInsert(key, fetch->title, url, error);
+			free(key);
+		}
+	}
+}
+
+// Output finished fetches in order, returning whether all succeeded.
+static bool fetchOutput(void) {
+	bool ok = true;
+	while (
+		fetches.head && fetches.head != fetches.pending && fetches.head->done
+	) {
+		struct Fetch *fetch = fetches.head;
+		if (fetch->title) {
+			showTitle(fetch->title);
+		} else if (fetch->error[0]) {
+			warnx("curl: %s", fetch->error);
+			ok = false;
+		}
+		fetches.head = fetch->next;
+		if (!fetches.head) fetches.tail = &fetches.head;
+		curl_easy_cleanup(fetch->curl);
+		free(fetch->key);
+		free(fetch->title);
+		free(fetch);
+	}
+	return ok;
+}
+
+static bool exclude;
+static regex_t excludeRegex;
+static regex_t urlRegex;
+
+static void handleLine(char *line) {
+	regmatch_t match = {0};
+	for (char *ptr = line; *ptr; ptr += match.rm_eo) {
+		if (regexec(&urlRegex, ptr, 1, &match, 0)) break;
+		char end = ptr[match.rm_eo];
+		ptr[match.rm_eo] = '\0';
+		const char *url = &ptr[match.rm_so];
+		if (!exclude || regexec(&excludeRegex, url, 0, NULL, 0)) {
+			fetchTitle(url);
+		}
+		ptr[match.rm_eo] = end;
+		if (!end) break;
+	}
+}
 
-	char *dest;
-	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &dest);
-	code = curl_easy_setopt(curl, CURLOPT_URL, dest);
-	if (code) return code;
+// Read what input is available, returning false at EOF.
+static bool readInput(void) {
+	static struct {
+		char *ptr;
+		size_t len, cap;
+	} buf;
+	if (buf.len + 1 >= buf.cap) {
+		buf.cap = (buf.cap ? buf.cap * 2 : 4096);
+		buf.ptr = realloc(buf.ptr, buf.cap);
+		if (!buf.ptr) err(EX_OSERR, "realloc");
+	}
+	ssize_t len = read(STDIN_FILENO, &buf.ptr[buf.len], buf.cap - buf.len - 1);
+	if (len < 0) err(EX_IOERR, "read");
+	buf.len += len;
+	buf.ptr[buf.len] = '\0';
 
-	body.len = 0;
-	title = false;
-	curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
-	code = curl_easy_perform(curl);
-	return code;
+	char *line = buf.ptr;
+	for (char *lf; NULL != (lf = strchr(line, '\n')); line = &lf[1]) {
+		*lf = '\0';
+		handleLine(line);
+	}
+	buf.len -= line - buf.ptr;
+	memmove(buf.ptr, line, buf.len);
+	if (!len && buf.len) {
+		buf.ptr[buf.len] = '\0';
+		handleLine(buf.ptr);
+		buf.len = 0;
+	}
+	return len;
+}
+
+static volatile sig_atomic_t quit;
+static void signalHandler(int signal) {
+	(void)signal;
+	quit = 1;
+}
+
+// Run transfers, reading input until EOF if input is true, until every
+// fetch is done or a signal is caught.
+static bool run(bool input) {
+	bool ok = true;
+	while (!quit) {
+		fetchStart();
+		if (!input && !fetches.head) return ok;
+
+		struct curl_waitfd fd = {
+			.fd = STDIN_FILENO,
+			.events = CURL_WAIT_POLLIN,
+		};
+		CURLMcode code = curl_multi_wait(multi, &fd, input, 1000, NULL);
+		if (code) {
+			errx(EX_SOFTWARE, "curl_multi_wait: %s", curl_multi_strerror(code));
+		}
+		if (input && fd.revents) input = readInput();
+
+		int running;
+		code = curl_multi_perform(multi, &running);
+		if (code) {
+			errx(
+				EX_SOFTWARE, "curl_multi_perform: %s",
+				curl_multi_strerror(code)
+			);
+		}
+		fetchDone();
+		ok &= fetchOutput();
+	}
+	return ok;
 }
 
 int main(int argc, char *argv[]) {
 	EntityRegex = regex(EntityPattern, 0);
-	TitleRegex = regex(TitlePattern, REG_ICASE);
 
 	setlocale(LC_CTYPE, "");
 	setlinebuf(stdout);
@@ -147,12 +843,15 @@ int main(int argc, char *argv[]) {
 	CURLcode code = curl_global_init(CURL_GLOBAL_ALL);
 	if (code) errx(EX_OSERR, "curl_global_init: %s", curl_easy_strerror(code));
 
+	// Transfers share the connection cache of the multi handle, and copy
+	// the options of this template handle.
+	multi = curl_multi_init();
+	if (!multi) errx(EX_SOFTWARE, "curl_multi_init");
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)Parallel * 2);
+
 	curl = curl_easy_init();
 	if (!curl) errx(EX_SOFTWARE, "curl_easy_init");
 
-	static char error[CURL_ERROR_SIZE];
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
-
 	curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, "curl/7.54.0");
 	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
@@ -160,14 +859,18 @@ int main(int argc, char *argv[]) {
 	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 3L);
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
 
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, handleHeader);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handleBody);
 
-	bool exclude = false;
-	regex_t excludeRegex;
+	const char *path = NULL;
+	bool stats = false;
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "x:v"))) {
+	while (0 < (opt = getopt(argc, argv, "c:st:x:v"))) {
 		switch (opt) {
+			break; case 'c': path = optarg;
+			break; case 's': stats = true;
+			break; case 't': ttl = strtol(optarg, NULL, 10);
 			break; case 'x': {
 				exclude = true;
 				excludeRegex = regex(optarg, REG_NOSUB);
@@ -177,28 +880,23 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	// Save the cache on the way out if interrupted.
+	if (path) {
+		cacheLoad(path);
+		signal(SIGINT, signalHandler);
+		signal(SIGTERM, signalHandler);
+	}
+
+	bool ok = true;
 	if (optind < argc) {
-		code = fetchTitle(argv[optind]);
-		if (!code) return EX_OK;
-		errx(EX_DATAERR, "curl_easy_perform: %s", error);
-	}
-
-	char *buf = NULL;
-	size_t cap = 0;
-
-	regex_t urlRegex = regex("https?://[^[:space:]>\"]+", 0);
-	while (0 < getline(&buf, &cap, stdin)) {
-		regmatch_t match = {0};
-		for (char *ptr = buf; *ptr; ptr += match.rm_eo) {
-			if (regexec(&urlRegex, ptr, 1, &match, 0)) break;
-			ptr[match.rm_eo] = '\0';
-			const char *url = &ptr[match.rm_so];
-			if (!exclude || regexec(&excludeRegex, url, 0, NULL, 0)) {
-				code = fetchTitle(url);
-				if (code) warnx("curl_easy_perform: %s", error);
-			}
-			ptr[match.rm_eo] = ' ';
-		}
+		fetchTitle(argv[optind]);
+		ok = run(false);
+	} else {
+		urlRegex = regex("https?://[^[:space:]>\"]+", 0);
+		run(true);
 	}
-	if (ferror(stdin)) err(EX_IOERR, "getline");
+
+	if (path) cacheSave(path);
+	if (stats) cacheStats();
+	return (ok ? EX_OK : EX_DATAERR);
 }